@@ -4,5 +4,5 @@
 
 # Used by "mix format"
 [
-  inputs: ["*.{ex,exs}", "{config,lib,test}/**/*.{ex,exs}"]
+  inputs: ["*.{ex,exs}", "{bench,config,lib,test}/**/*.{ex,exs}"]
 ]
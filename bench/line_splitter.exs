@@ -0,0 +1,142 @@
+# SPDX-FileCopyrightText: 2025 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+# Compare MuonTrap.Daemon's line splitting to the String.split version that
+# it replaced. Run with:
+#
+#   mix run bench/line_splitter.exs
+#
+# Each case feeds 16 MB of output through the splitter in 4 KB chunks (the
+# size of muontrap's packets) in a fresh process. Reductions and the heap
+# words that the process's garbage collections reclaimed are reported per MB
+# of output. The collections are traced so that other processes' don't count.
+
+defmodule Bench.StringSplit do
+  @max_data_to_buffer 256
+
+  def process_data(data) do
+    data |> String.split("\n") |> process_lines([])
+  end
+
+  defp process_lines([leftovers], acc) do
+    {Enum.reverse(acc), trim_buffer(leftovers)}
+  end
+
+  defp process_lines([line | rest], acc) do
+    process_lines(rest, [line | acc])
+  end
+
+  defp trim_buffer(data) when byte_size(data) > @max_data_to_buffer,
+    do: :binary.part(data, 0, @max_data_to_buffer)
+
+  defp trim_buffer(data), do: data
+end
+
+defmodule Bench.LineSplitter do
+  @total_bytes 16 * 1024 * 1024
+  @chunk_bytes 4096
+
+  def run() do
+    for {name, line_length} <- [
+          {"80 byte lines", 80},
+          {"1 KB lines", 1024},
+          {"no newlines", nil}
+        ] do
+      chunks = chunks(line_length)
+      IO.puts("#{name}:")
+      report("  String.split", measure(chunks, &string_split/2))
+      report("  :binary.matches", measure(chunks, &binary_matches/2))
+    end
+  end
+
+  defp chunks(line_length) do
+    data =
+      case line_length do
+        nil -> :binary.copy("x", @total_bytes)
+        n -> :binary.copy(:binary.copy("x", n - 1) <> "\n", div(@total_bytes, n))
+      end
+
+    for <<chunk::binary-size(@chunk_bytes) <- data>>, do: :binary.copy(chunk)
+  end
+
+  defp string_split(buffer, chunk), do: Bench.StringSplit.process_data(buffer <> chunk)
+  defp binary_matches(buffer, chunk), do: MuonTrap.Daemon.process_data(buffer, chunk, 256)
+
+  defp measure(chunks, fun) do
+    parent = self()
+
+    pid =
+      spawn(fn ->
+        # Start with an empty heap and wait for the tracing to start
+        :erlang.garbage_collect()
+        send(parent, :ready)
+
+        receive do
+          :go -> :ok
+        end
+
+        {:reductions, reductions_before} = Process.info(self(), :reductions)
+
+        {usec, _buffer} =
+          :timer.tc(fn ->
+            Enum.reduce(chunks, "", fn chunk, buffer ->
+              {lines, buffer} = fun.(buffer, chunk)
+              _ = length(lines)
+              buffer
+            end)
+          end)
+
+        {:reductions, reductions_after} = Process.info(self(), :reductions)
+
+        # Collect whatever garbage is left so that it's counted too
+        :erlang.garbage_collect()
+        send(parent, {:result, usec, reductions_after - reductions_before})
+      end)
+
+    receive do
+      :ready -> :ok
+    end
+
+    :erlang.trace(pid, true, [:garbage_collection])
+    send(pid, :go)
+
+    receive do
+      {:result, usec, reductions} ->
+        ref = :erlang.trace_delivered(pid)
+
+        receive do
+          {:trace_delivered, ^pid, ^ref} -> :ok
+        end
+
+        {usec, reductions, reclaimed_words(pid, 0)}
+    end
+  end
+
+  # Each collection reclaims the difference between the heap sizes that are
+  # reported when it starts and ends
+  defp reclaimed_words(pid, total) do
+    receive do
+      {:trace, ^pid, start, before} when start in [:gc_minor_start, :gc_major_start] ->
+        receive do
+          {:trace, ^pid, finish, later} when finish in [:gc_minor_end, :gc_major_end] ->
+            reclaimed_words(pid, total + heap_words(before) - heap_words(later))
+        end
+    after
+      0 -> total
+    end
+  end
+
+  defp heap_words(info), do: info[:heap_size] + info[:old_heap_size]
+
+  defp report(name, {usec, reductions, words}) do
+    mb = @total_bytes / (1024 * 1024)
+
+    IO.puts(
+      "#{String.pad_trailing(name, 20)} #{round(usec / mb)} us/MB, " <>
+        "#{round(reductions / mb)} reductions/MB, #{round(words / mb)} words garbage collected/MB"
+    )
+  end
+end
+
+Bench.LineSplitter.run()
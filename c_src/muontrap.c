@@ -17,12 +17,24 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#define HAVE_EPOLL
+#define HAVE_SIGNALFD
+#endif
+
 // IMPORTANT:
 // The FATAL* macros mirror err(3) and errx(3) which also exit. Exiting does not clean up
 // the child process which defeats one of the reasons to use MuonTrap in the first place.
@@ -56,9 +68,27 @@ static struct option long_options[] = {
     {"gid", required_argument, 0, 'a'},
     {"groups", required_argument, 0, 'G'},
     {"stdio-window", required_argument, 0, 'l'},
+    {"stdio-window-min", required_argument, 0, 'm'},
+    {"stdio-window-max", required_argument, 0, 'M'},
     {"capture-output", no_argument, 0, 'o'},
     {"capture-stderr", no_argument, 0, 'e'},
     {"capture-stderr-only", no_argument, 0, 'r'},
+    {"separate-stderr", no_argument, 0, 'S'},
+    {"line-max", required_argument, 0, 'L'},
+    {"forward-stdin", no_argument, 0, 'i'},
+    {"reuse-group", no_argument, 0, 'R'},
+    {"tail-bytes", required_argument, 0, 't'},
+    {"output-file", required_argument, 0, 'f'},
+    {"output-file-max-bytes", required_argument, 0, 'b'},
+    {"output-file-keep", required_argument, 0, 'K'},
+    {"resource-usage", no_argument, 0, 'U'},
+    {"stats-interval", required_argument, 0, 'I'},
+    {"pressure-trigger", required_argument, 0, 'P'},
+    {"cgroup-events", no_argument, 0, 'E'},
+    {"batch-bytes", required_argument, 0, 'B'},
+    {"pipe-size", required_argument, 0, 'Z'},
+    {"batch-usecs", required_argument, 0, 'T'},
+    {"protocol", required_argument, 0, 'p'},
     {0,          0,                 0, 0 }
 };
 
@@ -82,6 +112,13 @@ static const char *cgroup_path = NULL;
 static char *full_cgroup_path = NULL;
 static char *cgroup_procs_file = NULL;
 static int brutal_kill_wait_ms = 500;
+
+// With --reuse-group, the cgroup is left in place at exit so that the next
+// muontrap can skip creating and configuring it. The cgroup's directory is
+// flock'd while in use so that a muontrap that gets it next waits for the
+// previous one to finish cleaning up.
+static int reuse_cgroup = 0;
+static int cgroup_lock_fd = -1;
 static uid_t run_as_uid = 0; // 0 means don't set, since we don't support privilege escalation
 static gid_t run_as_gid = 0; // 0 means don't set, since we don't support privilege escalation
 static const char *run_as_user_name = NULL; // set when --uid was a name; triggers initgroups()
@@ -95,17 +132,258 @@ static int explicit_groups = 0;        // 1 if --groups was given (even with emp
 static int num_explicit_groups = 0;
 static gid_t explicit_group_ids[MAX_SUPPLEMENTARY_GROUPS];
 
+// Signals that muontrap handles are read from signal_fd. On Linux, this is a
+// signalfd. Elsewhere, it's the read end of a pipe written by a signal handler.
+static int signal_fd = -1;
+#ifdef HAVE_SIGNALFD
+static sigset_t original_sigmask;
+#else
 static int signal_pipe[2] = { -1, -1};
+#endif
+
+// A pidfd for the child when supported (Linux 5.3+). Otherwise, -1 and child
+// exits are found via SIGCHLD.
+static int child_pidfd = -1;
+
 static int stdout_pipe[2] = { -1, -1};
 static int stderr_pipe[2] = { -1, -1};
 
+// With --pipe-size, the output pipes and the pipe to Erlang are enlarged so
+// that programs that output a lot block less often and each splice moves
+// more. Linux limits unprivileged sizes to /proc/sys/fs/pipe-max-size (1 MB
+// by default), so failing to resize isn't fatal.
+static int pipe_size = 0; // 0 for the default size
+
 #define DEFAULT_STDIO_WINDOW 10240 // Allow up to 10 KB out to Elixir at a time
 #define ACK_WAIT_TIMEOUT_MS 10000 // Max time to wait for stdio acks before exiting
 static int stdio_bytes_max = DEFAULT_STDIO_WINDOW;
 static int stdio_bytes_avail = DEFAULT_STDIO_WINDOW;
+
+// With --stdio-window-min/max, the window adapts to how fast Erlang handles
+// output. Running out of window and getting acks back quickly means the
+// window is what's holding the command back, so it doubles. Waiting a long
+// time for acks means Erlang isn't keeping up and output is piling up in its
+// mailbox, so it halves.
+#define ADAPT_GROW_STALL_US 2000 // Grow if acks reopen the window faster than this
+#define ADAPT_SHRINK_STALL_US 100000 // Shrink if acks take longer than this
+static int stdio_window_min = 0;
+static int stdio_window_max = 0; // 0 when the window doesn't adapt
+static int stdio_stalled = 0; // 1 when out of window and waiting for acks
+static int stdio_stall_start_us = 0;
 static int capture_output = 0; // Don't capture output by default
 static int capture_stderr = 0; // If capturing output, don't capture stderr by default
 static int capture_stderr_only = 0; // Capture stderr only, ignore stdout
+static int separate_stderr = 0; // Send captured stderr in its own packets (protocol 2)
+
+// Protocol 1 sends raw output to Erlang and receives one byte acks. Each ack
+// byte is one less than the number of bytes acknowledged.
+//
+// Protocol 2 frames everything in both directions with a 4-byte big endian
+// length like Erlang's {packet, 4} port option. The first byte of each packet
+// is its type.
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+static int protocol_version = PROTOCOL_V1;
+
+#define PACKET_ACK    0x01 // Erlang->muontrap: uint32 count of output bytes handled
+#define PACKET_OUTPUT 0x02 // muontrap->Erlang: captured output
+#define PACKET_WINDOW 0x03 // muontrap->Erlang: uint32 new stdio window size
+#define PACKET_STDERR 0x04 // muontrap->Erlang: captured stderr when kept separate
+#define PACKET_LINE   0x05 // muontrap->Erlang: uint8 line flags followed by one line
+#define PACKET_STDIN  0x06 // Erlang->muontrap: data for the child's stdin
+#define PACKET_STDIN_EOF 0x07 // Erlang->muontrap: close the child's stdin after writing what's buffered
+#define PACKET_STDIN_CREDIT 0x08 // muontrap->Erlang: uint32 count of stdin bytes written to the child
+#define PACKET_TAIL   0x09 // muontrap->Erlang: the last --tail-bytes of output, sent before exiting
+#define PACKET_USAGE  0x0a // muontrap->Erlang: resource usage entries, sent before exiting
+#define PACKET_STATS  0x0b // muontrap->Erlang: uint32 ms since the last sample, then changed stats
+#define PACKET_PRESSURE 0x0c // muontrap->Erlang: uint8 trigger index, then the pressure file
+#define PACKET_EVENTS 0x0d // muontrap->Erlang: uint8 event file id, then the counters that changed
+
+#define LINE_FLAG_STDERR    0x01 // Line came from stderr when kept separate
+#define LINE_FLAG_TRUNCATED 0x02 // Line was longer than --line-max and the rest was dropped
+
+#define PACKET_HEADER_SIZE 5 // 4 byte length + 1 byte type
+#define PACKET_BUFFER_SIZE 4096
+static uint8_t packet_buffer[PACKET_BUFFER_SIZE];
+static size_t packet_buffer_len = 0;
+
+// With --line-max, output is split into lines here so that Erlang gets one
+// line per packet. Each captured pipe has its own buffer so that partial
+// lines from stdout and stderr don't get mixed together.
+struct line_framer {
+    uint8_t *buffer; // buffer[0] is for the flags. The line starts at buffer[1]
+    size_t len;
+    int discarding; // 1 when dropping the rest of a truncated line
+};
+static size_t line_max = 0; // 0 to send output as is
+static struct line_framer stdout_lines;
+static struct line_framer stderr_lines;
+
+// With --forward-stdin, Erlang sends data for the child's stdin in STDIN
+// packets. Erlang starts with DEFAULT_STDIN_WINDOW bytes of credit and gets
+// more back as the child reads, so the buffer here never overflows and a
+// child that stops reading stalls Erlang rather than muontrap.
+#define DEFAULT_STDIN_WINDOW 65536
+static int forward_stdin = 0;
+static int stdin_pipe[2] = { -1, -1};
+static uint8_t *stdin_buffer = NULL;
+static size_t stdin_buffer_start = 0;
+static size_t stdin_buffer_len = 0;
+static int stdin_eof_requested = 0;
+
+// With --tail-bytes, the most recent output is kept in a ring buffer and sent
+// to Erlang at exit. Stdout is read for the tail even when Erlang doesn't
+// want it. It's dropped here rather than sent and costs no window.
+static size_t tail_bytes = 0; // 0 to not keep a tail
+static uint8_t *tail_buffer = NULL;
+static size_t tail_start = 0;
+static size_t tail_len = 0;
+static int tail_only = 0; // 1 when output is only read for the tail
+
+// With --batch-bytes, output for Erlang is collected here until there's that
+// much or the oldest byte has waited --batch-usecs, like Nagle's algorithm.
+// Programs that write many small lines then cause fewer, larger messages.
+// The window is charged when output is read, so a batch is also sent when the
+// window runs out. Stdout and stderr have their own batches since they may go
+// in different packets.
+#define MAX_BATCH_BYTES 65536
+#define DEFAULT_BATCH_USECS 5000
+struct output_batch {
+    uint8_t type;
+    uint8_t *buffer;
+    size_t len;
+    int start_us; // When the first byte in the batch was read
+};
+static size_t batch_bytes = 0; // 0 to send output as soon as it's read
+static int batch_usecs = DEFAULT_BATCH_USECS;
+static struct output_batch batches[2] = {
+    { PACKET_OUTPUT, NULL, 0, 0 },
+    { PACKET_STDERR, NULL, 0, 0 }
+};
+
+// With --output-file, captured output is written to a file instead of being
+// sent to Erlang. Stderr kept separate with --separate-stderr still goes to
+// Erlang. The file is rotated to <path>.1, <path>.2, etc. when it reaches
+// --output-file-max-bytes.
+static const char *output_file_path = NULL;
+static int output_file_fd = -1;
+static off_t output_file_size = 0;
+static off_t output_file_max_bytes = 0; // 0 to never rotate
+static int output_file_keep = 1;
+
+// With --resource-usage, the child's rusage and the cgroup's final counters
+// are sent to Erlang before exiting. The payload is a list of entries that
+// are each a uint8 name length, the name, a uint32 data length and the data.
+// The data is in the format of a cgroup interface file.
+static int report_usage = 0;
+static uint8_t *usage_payload = NULL;
+static size_t usage_payload_len = 0;
+
+// With --stats-interval, the cgroup's stat files are kept open and sampled
+// periodically. Each sample is sent as a STATS packet with a uint8 stat id
+// and uint64 value for each stat that changed since the last one. Rates are
+// computed here from the change since the last sample. Pressure averages are
+// sent as hundredths of a percent.
+enum stat_id {
+    STAT_MEMORY_CURRENT = 1,
+    STAT_PIDS_CURRENT,
+    STAT_CPU_USAGE_USEC,
+    STAT_CPU_PERCENT, // hundredths of a percent of one CPU
+    STAT_IO_READ_BYTES,
+    STAT_IO_WRITE_BYTES,
+    STAT_IO_READ_BYTES_PER_SEC,
+    STAT_IO_WRITE_BYTES_PER_SEC,
+    STAT_MEMORY_PRESSURE_AVG10,
+    STAT_CPU_PRESSURE_AVG10,
+    STAT_IO_PRESSURE_AVG10,
+    STAT_COUNT
+};
+
+enum stat_file {
+    STAT_FILE_MEMORY_CURRENT,
+    STAT_FILE_PIDS_CURRENT,
+    STAT_FILE_CPU_STAT,
+    STAT_FILE_IO_STAT,
+    STAT_FILE_MEMORY_PRESSURE,
+    STAT_FILE_CPU_PRESSURE,
+    STAT_FILE_IO_PRESSURE,
+    STAT_FILE_COUNT
+};
+
+static const char *stat_file_names[STAT_FILE_COUNT] = {
+    "memory.current", "pids.current", "cpu.stat", "io.stat",
+    "memory.pressure", "cpu.pressure", "io.pressure"
+};
+
+static int stats_interval_ms = 0; // 0 to not sample
+static int stat_fds[STAT_FILE_COUNT];
+static int stats_sampled = 0; // 1 once there's a previous sample
+static uint64_t last_stats[STAT_COUNT];
+static int last_stats_us = 0;
+
+// With --pressure-trigger, PSI triggers are registered on the cgroup's
+// pressure files. The kernel wakes up pollers with POLLPRI when a trigger's
+// stall threshold is crossed within its window, and at most once per window.
+// Each time a trigger fires, a PRESSURE packet with the trigger's index in
+// the order given and the pressure file's current contents is sent.
+#define MAX_PRESSURE_TRIGGERS 6
+struct pressure_trigger {
+    char *file; // e.g., "memory.pressure"
+    char *trigger; // e.g., "some 150000 1000000"
+    int fd;
+};
+static struct pressure_trigger pressure_triggers[MAX_PRESSURE_TRIGGERS];
+static int pressure_trigger_count = 0;
+
+// With --cgroup-events, memory.events and pids.events are watched. The kernel
+// wakes up pollers with POLLPRI when one of their counters changes. Each time
+// that happens, an EVENTS packet with the file's id and the "key value" lines
+// that changed since the last read is sent.
+enum event_file {
+    EVENT_FILE_MEMORY,
+    EVENT_FILE_PIDS,
+    EVENT_FILE_COUNT
+};
+
+static const char *event_file_names[EVENT_FILE_COUNT] = { "memory.events", "pids.events" };
+
+static int watch_cgroup_events = 0;
+static int event_fds[EVENT_FILE_COUNT] = { -1, -1 };
+static char *last_events[EVENT_FILE_COUNT]; // Previous contents with a leading '\n'
+
+// clone3(2) with CLONE_INTO_CGROUP (Linux 5.7+) starts the child directly in
+// its cgroup. The struct is declared here rather than pulled from
+// <linux/sched.h> so that builds don't need the kernel headers.
+#if defined(__linux__) && defined(SYS_clone3)
+#define HAVE_CLONE_INTO_CGROUP
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x1000
+#endif
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+struct muontrap_clone_args {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+#endif
+
+#if defined(__linux__) && defined(SYS_pidfd_open) && defined(SYS_pidfd_send_signal)
+#define HAVE_PIDFD
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+#endif
 
 #define FOREACH_CONTROLLER for (struct controller_info *controller = controllers; controller != NULL; controller = controller->next)
 
@@ -123,9 +401,32 @@ static void usage()
     printf("--set,-s <cgroup variable>=<value>\n (may be specified multiple times)\n");
     printf("--delay-to-sigkill,-k <milliseconds>\n");
     printf("--stdio-window <bytes>\n");
+    printf("--stdio-window-min <bytes> with --stdio-window-max, adapt the window\n");
+    printf("--stdio-window-max <bytes>   to Erlang's throughput within these bounds\n");
     printf("--capture-output\n");
     printf("--capture-stderr\n");
     printf("--capture-stderr-only\n");
+    printf("--separate-stderr capture stderr in its own packets (protocol 2 only)\n");
+    printf("--line-max <bytes> send output one line per packet, truncating lines\n");
+    printf("                   longer than this (protocol 2 only)\n");
+    printf("--forward-stdin pass data from Erlang to the program's stdin (protocol 2 only)\n");
+    printf("--reuse-group use the cgroup as is if it exists and don't remove it at exit\n");
+    printf("--tail-bytes <bytes> send the last output to Erlang before exiting (protocol 2 only)\n");
+    printf("--resource-usage send the program's resource usage to Erlang before exiting\n");
+    printf("                 (protocol 2 only)\n");
+    printf("--stats-interval <ms> send cgroup stats to Erlang this often (protocol 2 only)\n");
+    printf("--pressure-trigger <memory|cpu|io>:<some|full>:<stall us>:<window us>\n");
+    printf("                   tell Erlang when the cgroup's pressure crosses this\n");
+    printf("                   (protocol 2 only, may be specified multiple times)\n");
+    printf("--pipe-size <bytes> enlarge the output pipes (Linux only)\n");
+    printf("--batch-bytes <bytes> hold output until there's this much to send at once\n");
+    printf("--batch-usecs <us> with --batch-bytes, the longest to hold output (default %d)\n", DEFAULT_BATCH_USECS);
+    printf("--cgroup-events send changes to memory.events and pids.events to Erlang\n");
+    printf("                (protocol 2 only)\n");
+    printf("--output-file <path> write captured output to this file instead of Erlang\n");
+    printf("--output-file-max-bytes <bytes> rotate the output file when it reaches this size\n");
+    printf("--output-file-keep <count> number of rotated output files to keep (default 1)\n");
+    printf("--protocol <1|2> Erlang communication protocol version (default 1)\n");
     printf("--uid <uid/user> drop privilege to this uid or user\n");
     printf("--gid <gid/group> drop privilege to this gid or group\n");
     printf("--groups <list> set supplementary groups (comma-separated gids/names;\n");
@@ -140,6 +441,49 @@ static int microsecs()
     return (ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
 }
 
+#ifdef HAVE_SIGNALFD
+static void handled_signals(sigset_t *mask, int include_sigchld)
+{
+    sigemptyset(mask);
+    if (include_sigchld)
+        sigaddset(mask, SIGCHLD);
+    sigaddset(mask, SIGINT);
+    sigaddset(mask, SIGQUIT);
+    sigaddset(mask, SIGTERM);
+}
+
+void enable_signal_handlers()
+{
+    sigset_t mask;
+    handled_signals(&mask, 1);
+    if (sigprocmask(SIG_BLOCK, &mask, &original_sigmask) < 0)
+        FATAL("sigprocmask");
+
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (signal_fd < 0)
+        FATAL("signalfd");
+}
+
+void disable_signal_handlers()
+{
+    // Signals stay blocked so that, like with the handlers on other
+    // platforms, they don't interrupt the final wait for acks.
+    close(signal_fd);
+    signal_fd = -1;
+}
+
+// Return the next signal number from signal_fd or -1 on error
+static int read_signal()
+{
+    struct signalfd_siginfo info;
+    ssize_t amt = read(signal_fd, &info, sizeof(info));
+    if (amt != sizeof(info)) {
+        WARN("read signal_fd");
+        return -1;
+    }
+    return (int) info.ssi_signo;
+}
+#else
 void sigchild_handler(int signum)
 {
     if (signal_pipe[1] >= 0 &&
@@ -149,6 +493,13 @@ void sigchild_handler(int signum)
 
 void enable_signal_handlers()
 {
+    if (pipe(signal_pipe) < 0)
+        FATAL("pipe");
+    if (fcntl(signal_pipe[0], F_SETFD, FD_CLOEXEC) < 0 ||
+        fcntl(signal_pipe[1], F_SETFD, FD_CLOEXEC) < 0)
+        WARN("fcntl(FD_CLOEXEC)");
+    signal_fd = signal_pipe[0];
+
     struct sigaction sa;
     sa.sa_handler = sigchild_handler;
     sigemptyset(&sa.sa_mask);
@@ -168,6 +519,131 @@ void disable_signal_handlers()
     sigaction(SIGTERM, NULL, NULL);
 }
 
+// Return the next signal number from signal_fd or -1 on error
+static int read_signal()
+{
+    int signal;
+    ssize_t amt = read(signal_fd, &signal, sizeof(signal));
+    if (amt != sizeof(signal)) {
+        WARN("read signal_pipe");
+        return -1;
+    }
+    return signal;
+}
+#endif
+
+// Start tracking the child via a pidfd if clone3 didn't already provide one.
+// Once there's a pidfd, SIGCHLD isn't needed and is no longer read.
+static void track_child(pid_t pid)
+{
+#ifdef HAVE_PIDFD
+    if (child_pidfd < 0)
+        child_pidfd = (int) syscall(SYS_pidfd_open, pid, 0);
+
+    if (child_pidfd < 0) {
+        INFO("pidfd_open not supported (%s). Using SIGCHLD", strerror(errno));
+        return;
+    }
+    INFO("tracking pid %d with pidfd %d", pid, child_pidfd);
+
+#ifdef HAVE_SIGNALFD
+    sigset_t mask;
+    handled_signals(&mask, 0);
+    if (signalfd(signal_fd, &mask, 0) < 0)
+        WARN("signalfd");
+
+    sigset_t sigchld_mask;
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+#endif
+#endif
+}
+
+static int signal_child(pid_t pid, int sig)
+{
+#ifdef HAVE_PIDFD
+    // Signaling through the pidfd can't hit a recycled pid
+    if (child_pidfd >= 0)
+        return (int) syscall(SYS_pidfd_send_signal, child_pidfd, sig, NULL, 0);
+#endif
+    return kill(pid, sig);
+}
+
+// Reap the child if it has exited without blocking. Returns 1 and sets
+// exit_status if it was reaped, 0 if it's still running, and -1 on error.
+static int reap_child(pid_t pid, int *exit_status)
+{
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+
+    int rc;
+#ifdef HAVE_PIDFD
+    if (child_pidfd >= 0)
+        rc = waitid((idtype_t) P_PIDFD, (id_t) child_pidfd, &info, WEXITED | WNOHANG);
+    else
+#endif
+        rc = waitid(P_PID, (id_t) pid, &info, WEXITED | WNOHANG);
+
+    if (rc < 0) {
+        WARN("waitid(%d)", pid);
+        return -1;
+    }
+
+    // No state change is reported as a zero si_pid
+    if (info.si_pid == 0)
+        return 0;
+
+    switch (info.si_code) {
+    case CLD_EXITED:
+        *exit_status = info.si_status;
+        INFO("child exited with exit status: %d", *exit_status);
+        break;
+
+    case CLD_KILLED:
+    case CLD_DUMPED:
+        // Crash on signal, return the signal in the exit status. See POSIX:
+        // http://pubs.opengroup.org/onlinepubs/9699919799/utilities/V3_chap02.html#tag_18_08_02
+        *exit_status = 128 + info.si_status;
+        INFO("child terminated via signal %d. our exit status: %d", info.si_status, *exit_status);
+        break;
+
+    default:
+        INFO("child terminated with unexpected code: %d", info.si_code);
+        *exit_status = EXIT_FAILURE;
+        break;
+    }
+    return 1;
+}
+
+#ifdef HAVE_CLONE_INTO_CGROUP
+// Fork the child straight into full_cgroup_path. This skips the write to
+// cgroup.procs and closes the window where the child runs outside of its
+// limits. Returns -1 with errno set if the kernel doesn't support it.
+static pid_t clone_into_cgroup()
+{
+    int cgroup_fd = open(full_cgroup_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cgroup_fd < 0)
+        return -1;
+
+    struct muontrap_clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_INTO_CGROUP | CLONE_PIDFD;
+    args.pidfd = (uint64_t) (uintptr_t) &child_pidfd;
+    args.exit_signal = SIGCHLD;
+    args.cgroup = (uint64_t) cgroup_fd;
+
+    pid_t pid = (pid_t) syscall(SYS_clone3, &args, sizeof(args));
+    if (pid != 0) {
+        // The child's copy is closed on exec.
+        int saved_errno = errno;
+        close(cgroup_fd);
+        errno = saved_errno;
+    }
+    return pid;
+}
+#endif
+
 static int fork_exec(const char *path, char *const *argv)
 {
     INFO("Running %s", path);
@@ -175,12 +651,40 @@ static int fork_exec(const char *path, char *const *argv)
         INFO("  arg: %s", *arg);
     }
 
-    pid_t pid = fork();
+    int needs_cgroup_move = (cgroup_path != NULL);
+    pid_t pid = -1;
+#ifdef HAVE_CLONE_INTO_CGROUP
+    // A reused cgroup has had cgroup.kill written to it by the muontrap
+    // before this one. Some kernels kill children cloned into a cgroup like
+    // that right away, so only move into those after forking.
+    if (cgroup_path && !reuse_cgroup) {
+        pid = clone_into_cgroup();
+        if (pid >= 0)
+            needs_cgroup_move = 0;
+        else
+            INFO("clone3(CLONE_INTO_CGROUP) failed (%s). Falling back to fork()", strerror(errno));
+    }
+#endif
+    if (pid < 0)
+        pid = fork();
+
     if (pid == 0) {
         // child
 
-        // Move to the container
-        if (cgroup_path)
+#ifdef HAVE_SIGNALFD
+        // Don't pass the signals blocked for the signalfd on to the program
+        sigprocmask(SIG_SETMASK, &original_sigmask, NULL);
+#endif
+        // Ignored signals stay ignored across exec. muontrap ignores SIGPIPE
+        // for itself with several options, but the program should get the
+        // default.
+        signal(SIGPIPE, SIG_DFL);
+
+        if (stdin_pipe[0] >= 0 && dup2(stdin_pipe[0], STDIN_FILENO) < 0)
+            FATAL("dup2 STDIN_FILENO");
+
+        // Move to the container unless clone3 already put us there
+        if (needs_cgroup_move)
             move_pid_to_cgroups(getpid());
 
         if (capture_stderr_only) {
@@ -263,6 +767,14 @@ static int fork_exec(const char *path, char *const *argv)
     }
 }
 
+static void close_pipe_end(int *fd)
+{
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
 static int mkdir_p(const char *abspath, int start_index)
 {
     int rc = 0;
@@ -528,17 +1040,19 @@ static void finish_controller_init()
     checked_asprintf(&cgroup_procs_file, "%s/cgroup.procs", full_cgroup_path);
 }
 
-static int wait_for_sigchld(pid_t pid_to_match, int timeout_ms)
+static int wait_for_child_exit(pid_t pid, int timeout_ms)
 {
-    struct pollfd fds[1];
-    fds[0].fd = signal_pipe[0];
+    struct pollfd fds[2];
+    fds[0].fd = signal_fd;
     fds[0].events = POLLIN;
+    fds[1].fd = child_pidfd; // Ignored by poll(2) when -1
+    fds[1].events = POLLIN;
 
     int end_timeout_us = microsecs() + (1000 * timeout_ms);
     int next_time_to_wait_ms = timeout_ms;
     do {
         INFO("poll - %d ms", next_time_to_wait_ms);
-        if (poll(fds, 1, next_time_to_wait_ms) < 0) {
+        if (poll(fds, 2, next_time_to_wait_ms) < 0) {
             if (errno == EINTR)
                 continue;
 
@@ -547,25 +1061,11 @@ static int wait_for_sigchld(pid_t pid_to_match, int timeout_ms)
         }
 
         if (fds[0].revents) {
-            int signal;
-            ssize_t amt = read(signal_pipe[0], &signal, sizeof(signal));
-            if (amt < 0) {
-                WARN("read signal_pipe");
-                return -1;
-            }
-
-            INFO("signal_pipe - SIGNAL %d", signal);
+            int signal = read_signal();
+            INFO("signal_fd - SIGNAL %d", signal);
             switch (signal) {
-            case SIGCHLD: {
-                int status;
-                pid_t pid = wait(&status);
-                if (pid_to_match == pid) {
-                    INFO("cleaned up matching pid %d.", pid);
-                    return 0;
-                }
-                INFO("cleaned up pid %d.", pid);
+            case SIGCHLD:
                 break;
-            }
 
             case SIGTERM:
             case SIGQUIT:
@@ -578,13 +1078,85 @@ static int wait_for_sigchld(pid_t pid_to_match, int timeout_ms)
             }
         }
 
+        if (fds[0].revents || fds[1].revents) {
+            int exit_status;
+            int rc = reap_child(pid, &exit_status);
+            if (rc < 0)
+                return -1;
+            if (rc > 0) {
+                INFO("cleaned up matching pid %d.", pid);
+                return 0;
+            }
+        }
+
         next_time_to_wait_ms = (end_timeout_us - microsecs()) / 1000;
     } while (next_time_to_wait_ms > 0);
 
-    INFO("timed out waiting for pid %d", pid_to_match);
+    INFO("timed out waiting for pid %d", pid);
     return -1;
 }
 
+// Check the "populated" key in cgroup.events. Returns 1 if processes are
+// still in the cgroup or its descendants, 0 if not, and -1 on error.
+static int cgroup_populated(int events_fd)
+{
+    char buffer[256];
+    ssize_t amt = pread(events_fd, buffer, sizeof(buffer) - 1, 0);
+    if (amt <= 0)
+        return -1;
+    buffer[amt] = '\0';
+
+    const char *populated = strstr(buffer, "populated ");
+    if (!populated)
+        return -1;
+
+    return populated[10] == '1' ? 1 : 0;
+}
+
+// Wait for the kernel to report the cgroup empty. The kernel wakes pollers
+// of cgroup.events with POLLPRI when it changes, so this doesn't need to
+// re-read cgroup.procs to find out. Those wakeups are rate limited to one per
+// 20 ms, though, so the file is re-read every couple of milliseconds too.
+// It's one small pread. Returns 0 when empty, 1 on timeout, and -1 if
+// cgroup.events can't be used.
+#define CGROUP_EVENTS_RECHECK_MS 2
+static int wait_for_cgroup_empty(int timeout_ms)
+{
+    char *events_file;
+    checked_asprintf(&events_file, "%s/cgroup.events", full_cgroup_path);
+    int events_fd = open(events_file, O_RDONLY | O_CLOEXEC);
+    free(events_file);
+    if (events_fd < 0)
+        return -1;
+
+    struct pollfd fds[1];
+    fds[0].fd = events_fd;
+    fds[0].events = POLLPRI;
+
+    int end_timeout_us = microsecs() + (1000 * timeout_ms);
+    int rc;
+    for (;;) {
+        rc = cgroup_populated(events_fd);
+        if (rc <= 0)
+            break;
+
+        int time_left_ms = (end_timeout_us - microsecs()) / 1000;
+        if (time_left_ms <= 0)
+            break;
+
+        INFO("waiting up to %d ms for cgroup to empty", time_left_ms);
+        if (time_left_ms > CGROUP_EVENTS_RECHECK_MS)
+            time_left_ms = CGROUP_EVENTS_RECHECK_MS;
+        if (poll(fds, 1, time_left_ms) < 0 && errno != EINTR) {
+            WARN("poll cgroup.events");
+            rc = -1;
+            break;
+        }
+    }
+    close(events_fd);
+    return rc;
+}
+
 static void cleanup_all_children()
 {
     // In order to cleanup the cgroup, all processes need to exit.
@@ -594,11 +1166,24 @@ static void cleanup_all_children()
     // they die. We only know who they are since they're in the cgroup.
 
     // Prefer cgroup.kill (kernel 5.14+) for atomic kill of the whole cgroup.
-    // Falls back to per-pid SIGKILL on older kernels. The per-pid kill loop
-    // below also serves to wait for processes to actually exit before rmdir.
-    (void) try_cgroup_kill();
+    // It gets processes forked while it's working too, so all that's left is
+    // to wait for the kernel to say that the cgroup is empty.
+    if (try_cgroup_kill() == 0) {
+        int rc = wait_for_cgroup_empty(brutal_kill_wait_ms);
+        if (rc == 0)
+            return;
+
+        if (rc > 0) {
+            WARNX("cgroup still populated after %d ms", brutal_kill_wait_ms);
+#ifdef DEBUG
+            dump_all_children_from_cgroups();
+#endif
+            return;
+        }
+    }
 
-    // Send every child a SIGKILL (no-op if cgroup.kill already did it)
+    // Fall back to per-pid SIGKILLs on older kernels. The loop also serves
+    // to wait for processes to actually exit before rmdir.
     int children_left = kill_children(SIGKILL);
     if (children_left > 0) {
         INFO("Found %d pids and sent them a SIGKILL", children_left);
@@ -624,23 +1209,63 @@ static void cleanup_all_children()
     }
 }
 
+// Open and lock a cgroup left behind by a muontrap run with --reuse-group.
+// Returns -1 if it doesn't exist yet.
+static int lock_reused_cgroup()
+{
+    cgroup_lock_fd = open(full_cgroup_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cgroup_lock_fd < 0)
+        return -1;
+
+    // The earlier muontrap holds the lock until it has killed what it ran.
+    // That takes two --delay-to-sigkill waits at most, so give up if it's
+    // taking much longer rather than hanging the new command.
+    int tries_left = (2 * brutal_kill_wait_ms + 1000) / 10;
+
+    INFO("flock %s", full_cgroup_path);
+    while (flock(cgroup_lock_fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK) {
+            if (tries_left-- <= 0)
+                FATALX("Timed out waiting for the last command in '%s' to be cleaned up", full_cgroup_path);
+            usleep(10000);
+        } else if (errno != EINTR) {
+            FATAL("flock '%s'", full_cgroup_path);
+        }
+    }
+    return 0;
+}
+
+static int cgroup_has_processes()
+{
+    char *events_file;
+    checked_asprintf(&events_file, "%s/cgroup.events", full_cgroup_path);
+    int events_fd = open(events_file, O_RDONLY | O_CLOEXEC);
+    free(events_file);
+    if (events_fd < 0)
+        return 1;
+
+    int rc = cgroup_populated(events_fd);
+    close(events_fd);
+    return rc != 0;
+}
+
 static void kill_child_nicely(pid_t child)
 {
     // Start with SIGTERM
-    int rc = kill(child, SIGTERM);
+    int rc = signal_child(child, SIGTERM);
     INFO("kill -%d %d -> %d (%s)", SIGTERM, child, rc, rc < 0 ? strerror(errno) : "success");
     if (rc < 0)
         return;
 
     // Wait a little for the child to exit
-    if (wait_for_sigchld(child, brutal_kill_wait_ms) < 0) {
+    if (wait_for_child_exit(child, brutal_kill_wait_ms) < 0) {
         // Child didn't exit, so SIGKILL it.
-        rc = kill(child, SIGKILL);
+        rc = signal_child(child, SIGKILL);
         INFO("kill -%d %d -> %d (%s)", SIGKILL, child, rc, rc < 0 ? strerror(errno) : "success");
         if (rc < 0)
             return;
 
-        if (wait_for_sigchld(child, brutal_kill_wait_ms) < 0)
+        if (wait_for_child_exit(child, brutal_kill_wait_ms) < 0)
             WARNX("SIGKILL didn't work on %d", child);
     }
 }
@@ -671,206 +1296,1601 @@ static void add_controller_setting(struct controller_info *controller, const cha
     controller->vars = new_var;
 }
 
-#if defined(__linux__)
-static int process_stdio(int from_fd)
+// Event loop
+//
+// Descriptors are registered once with ev_add() and afterwards only their
+// interest changes. Linux uses epoll. Elsewhere, a pollfd array that mirrors
+// the registrations is handed to poll(2) as is.
+#define EV_READ  0x01
+#define EV_PRI   0x02
+#define EV_WRITE 0x04
+#define EV_HUP   0x08 // Reported only
+#define EV_ERR   0x10 // Reported only
+
+#define EV_MAX_SOURCES 16
+
+enum ev_tag {
+    EV_TAG_ACKS,
+    EV_TAG_SIGNAL,
+    EV_TAG_CHILD,
+    EV_TAG_STDIO,
+    EV_TAG_CHILD_STDIN,
+    EV_TAG_PRESSURE,
+    EV_TAG_CGROUP_EVENTS
+};
+
+struct ev_source {
+    int fd;
+    enum ev_tag tag;
+    int interest;
+};
+
+struct ev_event {
+    int fd;
+    enum ev_tag tag;
+    int events;
+};
+
+static struct ev_source ev_sources[EV_MAX_SOURCES];
+static int ev_source_count = 0;
+#ifdef HAVE_EPOLL
+static int ev_fd = -1;
+#else
+static struct pollfd ev_pollfds[EV_MAX_SOURCES];
+#endif
+
+static void ev_init()
 {
-    ssize_t written;
-    if (stdio_bytes_avail <= 0)
-        return 0;
+#ifdef HAVE_EPOLL
+    ev_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ev_fd < 0)
+        FATAL("epoll_create1");
+#endif
+}
 
-retry:
-    written = splice(from_fd, NULL, STDOUT_FILENO, NULL, stdio_bytes_avail, SPLICE_F_MOVE);
-    if (written < 0) {
-        if (errno == EINTR)
-            goto retry;
+static struct ev_source *ev_find(int fd)
+{
+    for (int i = 0; i < ev_source_count; i++) {
+        if (ev_sources[i].fd == fd)
+            return &ev_sources[i];
+    }
+    return NULL;
+}
 
-        WARN("failed to splice stdio (%d bytes)", stdio_bytes_avail);
+#ifdef HAVE_EPOLL
+// epoll always reports EPOLLHUP and EPOLLERR, even with an empty interest
+// mask. To keep a closed pipe from waking the loop while its reads are
+// paused, descriptors without any interest are kept out of the epoll set.
+static int ev_apply(struct ev_source *source, int old_interest)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    if (source->interest & EV_READ)
+        ev.events |= EPOLLIN;
+    if (source->interest & EV_PRI)
+        ev.events |= EPOLLPRI;
+    if (source->interest & EV_WRITE)
+        ev.events |= EPOLLOUT;
+    ev.data.u64 = ((uint64_t) source->tag << 32) | (uint32_t) source->fd;
+
+    int op;
+    if (old_interest == 0 && source->interest == 0)
+        return 0;
+    else if (old_interest == 0)
+        op = EPOLL_CTL_ADD;
+    else if (source->interest == 0)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    if (epoll_ctl(ev_fd, op, source->fd, &ev) < 0) {
+        WARN("epoll_ctl(%d, %d)", op, source->fd);
         return -1;
     }
-    stdio_bytes_avail -= written;
     return 0;
 }
 #else
-static int process_stdio(int from_fd)
+static int ev_apply(struct ev_source *source, int old_interest)
 {
-    if (stdio_bytes_avail <= 0)
-        return 0;
-
-    size_t max_to_read = stdio_bytes_avail > 4096 ? 4096 : stdio_bytes_avail;
-    char buff[max_to_read];
-    ssize_t got = read(from_fd, buff, max_to_read);
-
-    if (got > 0) {
-        for (ssize_t i = 0; i < got;) {
-            ssize_t written = write(STDOUT_FILENO, &buff[i], got - i);
-
-            if (written <= 0) {
-                if (errno == EINTR)
-                    continue;
-
-                WARN("failed to copy stdio");
-                return -1;
-            }
-            stdio_bytes_avail -= written;
-            i += written;
-        }
-    }
+    struct pollfd *pfd = &ev_pollfds[source - ev_sources];
+
+    // poll(2) skips negative fds, so this also suppresses POLLHUP
+    pfd->fd = source->interest ? source->fd : -1;
+    pfd->events = 0;
+    if (source->interest & EV_READ)
+        pfd->events |= POLLIN;
+    if (source->interest & EV_PRI)
+        pfd->events |= POLLPRI;
+    if (source->interest & EV_WRITE)
+        pfd->events |= POLLOUT;
+    pfd->revents = 0;
     return 0;
 }
 #endif
 
-// Process acknowledgments from Erlang for captured output. Returns -1 on
-// EOF, a read error, or more acks than bytes sent.
-static int process_acks()
+static int ev_add(int fd, enum ev_tag tag, int interest)
 {
-    uint8_t acknowledgments[32];
-    ssize_t amt = read(STDIN_FILENO, acknowledgments, sizeof(acknowledgments));
-    if (amt > 0) {
-        // More than one acknowledgment may have come in, so process them all.
-        // NOTE: each ack is 1+its_value
-        int total_acks = amt;
-        for (ssize_t i = 0; i < amt; i++)
-            total_acks += acknowledgments[i];
-
-        stdio_bytes_avail += total_acks;
-        if (stdio_bytes_avail > stdio_bytes_max) {
-            WARNX("Too many acks %d/%d, got %d", (int) stdio_bytes_avail, (int) stdio_bytes_max, total_acks);
-            return -1;
-        }
-    } else if (amt == 0) {
-        INFO("eof on STDIN_FILENO");
-        return -1;
-    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
-        INFO("read STDIN_FILENO error: %s", strerror(errno));
+    if (ev_source_count >= EV_MAX_SOURCES) {
+        WARNX("too many event sources");
         return -1;
     }
 
-    return 0;
+    struct ev_source *source = &ev_sources[ev_source_count++];
+    source->fd = fd;
+    source->tag = tag;
+    source->interest = interest;
+    return ev_apply(source, 0);
 }
 
-// Wait for Erlang to acknowledge all captured output before exiting. Exiting
-// with acks in flight makes the Erlang-side write fail with EPIPE, and the
-// port kills the process that ran the command with reason :epipe.
-static void wait_for_acks()
+static int ev_modify(int fd, int interest)
 {
-    struct pollfd fds[1];
-    fds[0].fd = STDIN_FILENO;
-    fds[0].events = POLLIN;
+    struct ev_source *source = ev_find(fd);
+    if (!source)
+        return -1;
 
-    while (stdio_bytes_avail < stdio_bytes_max) {
-        int rc = poll(fds, 1, ACK_WAIT_TIMEOUT_MS);
-        if (rc < 0 && errno == EINTR)
-            continue;
+    int old_interest = source->interest;
+    if (old_interest == interest)
+        return 0;
 
-        if (rc <= 0) {
-            // Erlang should have acknowledged by now, so give up rather than hang.
-            WARNX("gave up waiting for acks (%d/%d)", (int) stdio_bytes_avail, (int) stdio_bytes_max);
-            return;
-        }
+    source->interest = interest;
+    return ev_apply(source, old_interest);
+}
 
-        if (fds[0].revents & POLLHUP) {
-            // Erlang closed the port, so no more acks are coming.
-            return;
-        }
+static void ev_remove(int fd)
+{
+    struct ev_source *source = ev_find(fd);
+    if (!source)
+        return;
 
-        if (process_acks() < 0)
-            return;
+    (void) ev_modify(fd, 0);
+
+    // Move the last registration into the hole
+    struct ev_source *last = &ev_sources[--ev_source_count];
+    if (source != last) {
+        *source = *last;
+#ifndef HAVE_EPOLL
+        ev_pollfds[source - ev_sources] = ev_pollfds[last - ev_sources];
+#endif
     }
 }
 
-static int child_wait_loop(pid_t child_pid, int *still_running)
+// Wait for events on the registered descriptors. Returns the number of events
+// or -1 on error. EINTR is reported as no events.
+static int ev_wait(struct ev_event *events, int max_events, int timeout_ms)
 {
-    struct pollfd fds[4];
-    fds[0].fd = STDIN_FILENO;
-    fds[0].events = POLLIN | POLLHUP; // POLLERR is implicit
-    fds[1].fd = signal_pipe[0];
-    fds[1].events = POLLIN;
-    fds[2].fd = stdout_pipe[0];
-    fds[2].events = POLLIN;
-    fds[3].fd = stderr_pipe[0];
-    fds[3].events = POLLIN;
-    int poll_num = 2;
+#ifdef HAVE_EPOLL
+    struct epoll_event ready[EV_MAX_SOURCES];
+    if (max_events > EV_MAX_SOURCES)
+        max_events = EV_MAX_SOURCES;
 
-    for (;;) {
-        poll_num = 2;
-        // Also poll stdout and optionally stderr when capturing output and accepting stdio data
-        if (capture_stderr_only && stdio_bytes_avail > 0) {
-            // Only polling stderr in stderr-only mode
-            // fds[2] will be stderr_pipe since we're not using stdout_pipe
-            fds[2].fd = stderr_pipe[0];
-            fds[2].events = POLLIN;
-            poll_num++;
-        } else if (capture_output && stdio_bytes_avail > 0) {
-            poll_num++;
-
-            if (capture_stderr)
-                poll_num++;
-        }
+    int count = epoll_wait(ev_fd, ready, max_events, timeout_ms);
+    if (count < 0) {
+        if (errno == EINTR)
+            return 0;
 
-        if (poll(fds, poll_num, -1) < 0) {
+        WARN("epoll_wait");
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        events[i].fd = (int) (uint32_t) ready[i].data.u64;
+        events[i].tag = (enum ev_tag) (ready[i].data.u64 >> 32);
+        events[i].events = 0;
+        if (ready[i].events & EPOLLIN)
+            events[i].events |= EV_READ;
+        if (ready[i].events & EPOLLPRI)
+            events[i].events |= EV_PRI;
+        if (ready[i].events & EPOLLOUT)
+            events[i].events |= EV_WRITE;
+        if (ready[i].events & EPOLLHUP)
+            events[i].events |= EV_HUP;
+        if (ready[i].events & EPOLLERR)
+            events[i].events |= EV_ERR;
+    }
+    return count;
+#else
+    int rc = poll(ev_pollfds, ev_source_count, timeout_ms);
+    if (rc < 0) {
+        if (errno == EINTR)
+            return 0;
+
+        WARN("poll");
+        return -1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < ev_source_count && count < max_events; i++) {
+        short revents = ev_pollfds[i].revents;
+        if (revents == 0)
+            continue;
+
+        events[count].fd = ev_sources[i].fd;
+        events[count].tag = ev_sources[i].tag;
+        events[count].events = 0;
+        if (revents & POLLIN)
+            events[count].events |= EV_READ;
+        if (revents & POLLPRI)
+            events[count].events |= EV_PRI;
+        if (revents & POLLOUT)
+            events[count].events |= EV_WRITE;
+        if (revents & POLLHUP)
+            events[count].events |= EV_HUP;
+        if (revents & (POLLERR | POLLNVAL))
+            events[count].events |= EV_ERR;
+        count++;
+    }
+    return count;
+#endif
+}
+
+static uint32_t get_be32(const uint8_t *buf)
+{
+    return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) | ((uint32_t) buf[2] << 8) | buf[3];
+}
+
+static void put_be32(uint8_t *buf, uint32_t value)
+{
+    buf[0] = (uint8_t) (value >> 24);
+    buf[1] = (uint8_t) (value >> 16);
+    buf[2] = (uint8_t) (value >> 8);
+    buf[3] = (uint8_t) value;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t written = write(fd, p, len);
+        if (written < 0) {
             if (errno == EINTR)
                 continue;
 
-            WARN("poll");
-            return EXIT_FAILURE;
+            WARN("write(%d)", fd);
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static void encode_packet_header(uint8_t *header, uint8_t type, size_t payload_len)
+{
+    put_be32(header, (uint32_t) (payload_len + 1));
+    header[4] = type;
+}
+
+// Send a protocol 2 packet to Erlang
+static int send_packet(uint8_t type, const void *payload, size_t len)
+{
+    uint8_t header[PACKET_HEADER_SIZE];
+    encode_packet_header(header, type, len);
+
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *) payload;
+    iov[1].iov_len = len;
+
+    ssize_t written;
+    do {
+        written = writev(STDOUT_FILENO, iov, 2);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) {
+        WARN("writev packet");
+        return -1;
+    }
+
+    // Finish up short writes
+    if ((size_t) written < sizeof(header)) {
+        if (write_all(STDOUT_FILENO, header + written, sizeof(header) - written) < 0)
+            return -1;
+        written = sizeof(header);
+    }
+    size_t payload_written = written - sizeof(header);
+    return write_all(STDOUT_FILENO, (const uint8_t *) payload + payload_written, len - payload_written);
+}
+
+static uint8_t output_packet_type(int from_fd)
+{
+    return separate_stderr && from_fd == stderr_pipe[0] ? PACKET_STDERR : PACKET_OUTPUT;
+}
+
+// Add output to the ring buffer of recent output
+static void record_tail(const void *data, size_t len)
+{
+    if (tail_bytes == 0)
+        return;
+
+    const uint8_t *p = data;
+    if (len >= tail_bytes) {
+        memcpy(tail_buffer, p + len - tail_bytes, tail_bytes);
+        tail_start = 0;
+        tail_len = tail_bytes;
+        return;
+    }
+
+    size_t end = (tail_start + tail_len) % tail_bytes;
+    size_t first = tail_bytes - end < len ? tail_bytes - end : len;
+    memcpy(tail_buffer + end, p, first);
+    memcpy(tail_buffer, p + first, len - first);
+
+    tail_len += len;
+    if (tail_len > tail_bytes) {
+        tail_start = (tail_start + tail_len - tail_bytes) % tail_bytes;
+        tail_len = tail_bytes;
+    }
+}
+
+static void add_usage_entry(const char *name, const char *data, size_t len)
+{
+    size_t name_len = strlen(name);
+    size_t entry_len = 1 + name_len + 4 + len;
+    uint8_t *payload = realloc(usage_payload, usage_payload_len + entry_len);
+    if (!payload) {
+        WARN("realloc");
+        return;
+    }
+
+    uint8_t *p = payload + usage_payload_len;
+    *p++ = (uint8_t) name_len;
+    memcpy(p, name, name_len);
+    p += name_len;
+    put_be32(p, (uint32_t) len);
+    memcpy(p + 4, data, len);
+
+    usage_payload = payload;
+    usage_payload_len += entry_len;
+}
+
+// Report the child's usage once it's been reaped. RUSAGE_CHILDREN covers
+// only the child since it's the only process that muontrap waits for. That
+// includes descendants that the child waited for.
+static void add_rusage()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_CHILDREN, &usage) < 0) {
+        WARN("getrusage");
+        return;
+    }
+
+#if defined(__APPLE__)
+    long maxrss_kb = usage.ru_maxrss / 1024; // bytes on macOS
+#else
+    long maxrss_kb = usage.ru_maxrss;
+#endif
+
+    char buffer[512];
+    int len = snprintf(buffer, sizeof(buffer),
+                       "utime_usec %lld\n"
+                       "stime_usec %lld\n"
+                       "maxrss_kb %ld\n"
+                       "minflt %ld\n"
+                       "majflt %ld\n"
+                       "inblock %ld\n"
+                       "oublock %ld\n"
+                       "nvcsw %ld\n"
+                       "nivcsw %ld\n",
+                       (long long) usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec,
+                       (long long) usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec,
+                       maxrss_kb,
+                       usage.ru_minflt,
+                       usage.ru_majflt,
+                       usage.ru_inblock,
+                       usage.ru_oublock,
+                       usage.ru_nvcsw,
+                       usage.ru_nivcsw);
+    add_usage_entry("rusage", buffer, len);
+}
+
+// Read the cgroup's counters after everything in it has exited and before
+// it's removed
+static void add_cgroup_usage()
+{
+    static const char *files[] = { "cpu.stat", "memory.peak", "io.stat" };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        char *path;
+        checked_asprintf(&path, "%s/%s", full_cgroup_path, files[i]);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        free(path);
+        if (fd < 0)
+            continue;
+
+        char buffer[4096];
+        ssize_t amt = read(fd, buffer, sizeof(buffer));
+        close(fd);
+        if (amt >= 0)
+            add_usage_entry(files[i], buffer, amt);
+    }
+}
+
+static void open_stat_files()
+{
+    for (int i = 0; i < STAT_FILE_COUNT; i++) {
+        char *path;
+        checked_asprintf(&path, "%s/%s", full_cgroup_path, stat_file_names[i]);
+        stat_fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+        if (stat_fds[i] < 0)
+            INFO("Not sampling %s (%s)", path, strerror(errno));
+        free(path);
+    }
+    last_stats_us = microsecs();
+}
+
+// Read a stat file from the start. Returns the length or -1 if the file isn't
+// available.
+static ssize_t read_stat_file(enum stat_file file, char *buffer, size_t len)
+{
+    if (stat_fds[file] < 0)
+        return -1;
+
+    ssize_t amt = pread(stat_fds[file], buffer, len - 1, 0);
+    if (amt < 0)
+        return -1;
+    buffer[amt] = '\0';
+    return amt;
+}
+
+// Sum the values of a key like "rbytes=" across the lines of a file
+static uint64_t sum_keyed_values(const char *buffer, const char *key)
+{
+    uint64_t total = 0;
+    size_t key_len = strlen(key);
+    for (const char *p = strstr(buffer, key); p; p = strstr(p + key_len, key))
+        total += strtoull(p + key_len, NULL, 10);
+    return total;
+}
+
+// Parse "some avg10=1.23 ..." into hundredths
+static int parse_pressure_avg10(const char *buffer, uint64_t *value)
+{
+    const char *p = strstr(buffer, "some avg10=");
+    if (!p)
+        return -1;
+
+    char *end;
+    unsigned long whole = strtoul(p + 11, &end, 10);
+    unsigned long fraction = 0;
+    if (*end == '.')
+        fraction = strtoul(end + 1, NULL, 10);
+    *value = (uint64_t) whole * 100 + fraction;
+    return 0;
+}
+
+static int stats_timeout_ms()
+{
+    if (stats_interval_ms == 0)
+        return -1;
+
+    int elapsed_ms = (microsecs() - last_stats_us) / 1000;
+    return elapsed_ms >= stats_interval_ms ? 0 : stats_interval_ms - elapsed_ms;
+}
+
+static int sample_stats()
+{
+    char buffer[4096];
+    uint64_t stats[STAT_COUNT];
+    int have[STAT_COUNT];
+    memset(have, 0, sizeof(have));
+
+    int now_us = microsecs();
+    int elapsed_us = now_us - last_stats_us;
+    if (elapsed_us <= 0)
+        elapsed_us = 1;
+
+    if (read_stat_file(STAT_FILE_MEMORY_CURRENT, buffer, sizeof(buffer)) > 0) {
+        stats[STAT_MEMORY_CURRENT] = strtoull(buffer, NULL, 10);
+        have[STAT_MEMORY_CURRENT] = 1;
+    }
+    if (read_stat_file(STAT_FILE_PIDS_CURRENT, buffer, sizeof(buffer)) > 0) {
+        stats[STAT_PIDS_CURRENT] = strtoull(buffer, NULL, 10);
+        have[STAT_PIDS_CURRENT] = 1;
+    }
+    if (read_stat_file(STAT_FILE_CPU_STAT, buffer, sizeof(buffer)) > 0 &&
+        strncmp(buffer, "usage_usec ", 11) == 0) {
+        stats[STAT_CPU_USAGE_USEC] = strtoull(buffer + 11, NULL, 10);
+        have[STAT_CPU_USAGE_USEC] = 1;
+
+        if (stats_sampled) {
+            uint64_t used_us = stats[STAT_CPU_USAGE_USEC] - last_stats[STAT_CPU_USAGE_USEC];
+            stats[STAT_CPU_PERCENT] = used_us * 10000 / elapsed_us;
+            have[STAT_CPU_PERCENT] = 1;
+        }
+    }
+    if (read_stat_file(STAT_FILE_IO_STAT, buffer, sizeof(buffer)) >= 0) {
+        stats[STAT_IO_READ_BYTES] = sum_keyed_values(buffer, "rbytes=");
+        stats[STAT_IO_WRITE_BYTES] = sum_keyed_values(buffer, "wbytes=");
+        have[STAT_IO_READ_BYTES] = 1;
+        have[STAT_IO_WRITE_BYTES] = 1;
+
+        if (stats_sampled) {
+            uint64_t read = stats[STAT_IO_READ_BYTES] - last_stats[STAT_IO_READ_BYTES];
+            uint64_t written = stats[STAT_IO_WRITE_BYTES] - last_stats[STAT_IO_WRITE_BYTES];
+            stats[STAT_IO_READ_BYTES_PER_SEC] = read * 1000000 / elapsed_us;
+            stats[STAT_IO_WRITE_BYTES_PER_SEC] = written * 1000000 / elapsed_us;
+            have[STAT_IO_READ_BYTES_PER_SEC] = 1;
+            have[STAT_IO_WRITE_BYTES_PER_SEC] = 1;
+        }
+    }
+    static const int pressure_stats[][2] = {
+        { STAT_FILE_MEMORY_PRESSURE, STAT_MEMORY_PRESSURE_AVG10 },
+        { STAT_FILE_CPU_PRESSURE, STAT_CPU_PRESSURE_AVG10 },
+        { STAT_FILE_IO_PRESSURE, STAT_IO_PRESSURE_AVG10 }
+    };
+    for (int i = 0; i < 3; i++) {
+        int id = pressure_stats[i][1];
+        if (read_stat_file(pressure_stats[i][0], buffer, sizeof(buffer)) > 0)
+            have[id] = parse_pressure_avg10(buffer, &stats[id]) == 0;
+    }
+
+    // Only send what changed and skip the packet if nothing did. The first
+    // sample sends everything.
+    uint8_t payload[4 + STAT_COUNT * 9];
+    size_t len = 4;
+    put_be32(payload, (uint32_t) (elapsed_us / 1000));
+    for (int id = 1; id < STAT_COUNT; id++) {
+        if (!have[id] || (stats_sampled && stats[id] == last_stats[id]))
+            continue;
+
+        payload[len] = (uint8_t) id;
+        put_be32(&payload[len + 1], (uint32_t) (stats[id] >> 32));
+        put_be32(&payload[len + 5], (uint32_t) stats[id]);
+        len += 9;
+        last_stats[id] = stats[id];
+    }
+
+    stats_sampled = 1;
+    last_stats_us = now_us;
+    if (len == 4)
+        return 0;
+
+    return send_packet(PACKET_STATS, payload, len);
+}
+
+static void add_pressure_trigger(const char *spec)
+{
+    if (pressure_trigger_count >= MAX_PRESSURE_TRIGGERS)
+        FATALX("Too many --pressure-trigger options");
+
+    char resource[8];
+    char kind[8];
+    unsigned long stall_us;
+    unsigned long window_us;
+    char extra;
+
+    // Without CAP_SYS_RESOURCE, the kernel only accepts windows that are
+    // multiples of 2 seconds. That's left for it to check when the trigger
+    // is registered since it depends on muontrap's capabilities.
+    if (sscanf(spec, "%7[a-z]:%7[a-z]:%lu:%lu%c", resource, kind, &stall_us, &window_us, &extra) != 4 ||
+        (strcmp(resource, "memory") != 0 && strcmp(resource, "cpu") != 0 && strcmp(resource, "io") != 0) ||
+        (strcmp(kind, "some") != 0 && strcmp(kind, "full") != 0) ||
+        stall_us == 0 || stall_us > window_us)
+        FATALX("Invalid --pressure-trigger '%s'", spec);
+
+    struct pressure_trigger *trigger = &pressure_triggers[pressure_trigger_count++];
+    checked_asprintf(&trigger->file, "%s.pressure", resource);
+    checked_asprintf(&trigger->trigger, "%s %lu %lu", kind, stall_us, window_us);
+    trigger->fd = -1;
+}
+
+// Register each --pressure-trigger with the cgroup's PSI file
+static int open_pressure_triggers()
+{
+    for (int i = 0; i < pressure_trigger_count; i++) {
+        struct pressure_trigger *trigger = &pressure_triggers[i];
+        char *path;
+        checked_asprintf(&path, "%s/%s", full_cgroup_path, trigger->file);
+
+        // The kernel wants the terminating NUL as part of the trigger
+        trigger->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (trigger->fd < 0 ||
+            write(trigger->fd, trigger->trigger, strlen(trigger->trigger) + 1) < 0) {
+            WARN("Can't set trigger '%s' on '%s'", trigger->trigger, path);
+            free(path);
+            return -1;
+        }
+        free(path);
+    }
+    return 0;
+}
+
+static int send_pressure(int fd)
+{
+    for (int i = 0; i < pressure_trigger_count; i++) {
+        if (pressure_triggers[i].fd != fd)
+            continue;
+
+        char payload[512];
+        payload[0] = i;
+        ssize_t amt = pread(fd, payload + 1, sizeof(payload) - 1, 0);
+        return send_packet(PACKET_PRESSURE, payload, amt > 0 ? amt + 1 : 1);
+    }
+    return 0;
+}
+
+// Read an event file and return its contents with a leading '\n' so that
+// whole lines can be found with strstr(). Reading also rearms the POLLPRI
+// notification.
+static char *read_events(int fd)
+{
+    char buffer[1024];
+    ssize_t amt = pread(fd, buffer + 1, sizeof(buffer) - 2, 0);
+    if (amt < 0)
+        return NULL;
+
+    buffer[0] = '\n';
+    buffer[amt + 1] = '\0';
+    return strdup(buffer);
+}
+
+static void open_event_files()
+{
+    for (int i = 0; i < EVENT_FILE_COUNT; i++) {
+        char *path;
+        checked_asprintf(&path, "%s/%s", full_cgroup_path, event_file_names[i]);
+        event_fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+        if (event_fds[i] >= 0)
+            last_events[i] = read_events(event_fds[i]);
+        else
+            INFO("Not watching %s (%s)", path, strerror(errno));
+        free(path);
+    }
+}
+
+static int send_events(int fd)
+{
+    for (int i = 0; i < EVENT_FILE_COUNT; i++) {
+        if (event_fds[i] != fd)
+            continue;
+
+        char *events = read_events(fd);
+        if (!events)
+            return 0;
+
+        // Send the lines that weren't in the previous read
+        char payload[1024];
+        size_t len = 0;
+        payload[len++] = i;
+        for (char *line = events + 1; *line; ) {
+            char *end = strchr(line, '\n');
+            size_t line_len = end ? (size_t) (end - line + 1) : strlen(line);
+            char saved = line[line_len];
+            line[line_len] = '\0';
+            if (!last_events[i] || !strstr(last_events[i], line - 1)) {
+                memcpy(&payload[len], line, line_len);
+                len += line_len;
+            }
+            line[line_len] = saved;
+            line += line_len;
+        }
+
+        free(last_events[i]);
+        last_events[i] = events;
+
+        return len > 1 ? send_packet(PACKET_EVENTS, payload, len) : 0;
+    }
+    return 0;
+}
+
+static int send_tail()
+{
+    // Unwrap the ring so that the tail goes out in order
+    uint8_t *tail = malloc(tail_len + 1);
+    if (!tail)
+        return -1;
+
+    size_t first = tail_bytes - tail_start < tail_len ? tail_bytes - tail_start : tail_len;
+    memcpy(tail, tail_buffer + tail_start, first);
+    memcpy(tail + first, tail_buffer, tail_len - first);
+
+    int rc = send_packet(PACKET_TAIL, tail, tail_len);
+    free(tail);
+    return rc;
+}
+
+// Forward captured output to Erlang. Returns -1 on error, 1 when the child
+// side of the pipe has been closed and drained, and 0 otherwise.
+#if defined(__linux__)
+// Splice what's in the pipe into one output packet. The header has to go out
+// first, so ask the pipe how much is there to size it.
+static int splice_packet(int from_fd, uint8_t type)
+{
+    int available;
+    if (ioctl(from_fd, FIONREAD, &available) < 0) {
+        WARN("ioctl(FIONREAD)");
+        return -1;
+    }
+
+    // Readable with nothing to read is EOF
+    if (available == 0)
+        return 1;
+
+    int amount = available < stdio_bytes_avail ? available : stdio_bytes_avail;
+    uint8_t header[PACKET_HEADER_SIZE];
+    encode_packet_header(header, type, amount);
+    if (write_all(STDOUT_FILENO, header, sizeof(header)) < 0)
+        return -1;
+
+    while (amount > 0) {
+        ssize_t written = splice(from_fd, NULL, STDOUT_FILENO, NULL, amount, SPLICE_F_MOVE);
+        if (written <= 0) {
+            if (written < 0 && errno == EINTR)
+                continue;
+
+            WARN("failed to splice packet (%d bytes left)", amount);
+            return -1;
+        }
+        amount -= written;
+        stdio_bytes_avail -= written;
+    }
+    return 0;
+}
+
+static int forward_stdio(int from_fd)
+{
+    ssize_t written;
+    if (protocol_version == PROTOCOL_V2)
+        return splice_packet(from_fd, output_packet_type(from_fd));
+
+retry:
+    written = splice(from_fd, NULL, STDOUT_FILENO, NULL, stdio_bytes_avail, SPLICE_F_MOVE);
+    if (written < 0) {
+        if (errno == EINTR)
+            goto retry;
+
+        WARN("failed to splice stdio (%d bytes)", stdio_bytes_avail);
+        return -1;
+    }
+    if (written == 0)
+        return 1;
+
+    stdio_bytes_avail -= written;
+    return 0;
+}
+#endif
+
+// Read output and send it. This is used when splice isn't available and when
+// output has to be seen here for the tail.
+static int copy_stdio(int from_fd)
+{
+    size_t max_to_read = stdio_bytes_avail > 4096 ? 4096 : stdio_bytes_avail;
+    char buff[max_to_read];
+    ssize_t got = read(from_fd, buff, max_to_read);
+    if (got == 0)
+        return 1;
+
+    if (got > 0)
+        record_tail(buff, got);
+
+    if (got > 0 && protocol_version == PROTOCOL_V2) {
+        if (send_packet(output_packet_type(from_fd), buff, got) < 0)
+            return -1;
+        stdio_bytes_avail -= got;
+    } else if (got > 0) {
+        for (ssize_t i = 0; i < got;) {
+            ssize_t written = write(STDOUT_FILENO, &buff[i], got - i);
+
+            if (written <= 0) {
+                if (errno == EINTR)
+                    continue;
+
+                WARN("failed to copy stdio");
+                return -1;
+            }
+            stdio_bytes_avail -= written;
+            i += written;
+        }
+    }
+    return 0;
+}
+
+static void set_pipe_size(int fd)
+{
+#ifdef F_SETPIPE_SZ
+    if (fd >= 0 && fcntl(fd, F_SETPIPE_SZ, pipe_size) < 0)
+        INFO("F_SETPIPE_SZ(%d, %d): %s", fd, pipe_size, strerror(errno));
+#else
+    (void) fd;
+#endif
+}
+
+static int send_batch(struct output_batch *batch)
+{
+    if (batch->len == 0)
+        return 0;
+
+    int rc = protocol_version == PROTOCOL_V2 ?
+             send_packet(batch->type, batch->buffer, batch->len) :
+             write_all(STDOUT_FILENO, batch->buffer, batch->len);
+    batch->len = 0;
+    return rc;
+}
+
+static int send_all_batches()
+{
+    if (send_batch(&batches[0]) < 0 || send_batch(&batches[1]) < 0)
+        return -1;
+    return 0;
+}
+
+// Read output into its batch and send the batch once it's full
+static int batch_stdio(int from_fd)
+{
+    struct output_batch *batch = &batches[output_packet_type(from_fd) == PACKET_STDERR];
+    size_t room = batch_bytes - batch->len;
+    if (room > (size_t) stdio_bytes_avail)
+        room = stdio_bytes_avail;
+
+    ssize_t got = read(from_fd, batch->buffer + batch->len, room);
+    if (got == 0)
+        return send_batch(batch) < 0 ? -1 : 1;
+    if (got < 0)
+        return errno == EINTR || errno == EAGAIN ? 0 : -1;
+
+    record_tail(batch->buffer + batch->len, got);
+    if (batch->len == 0)
+        batch->start_us = microsecs();
+    batch->len += got;
+    stdio_bytes_avail -= got;
+
+    if (batch->len >= batch_bytes || stdio_bytes_avail <= 0)
+        return send_batch(batch);
+    return 0;
+}
+
+// Milliseconds until the oldest batch is due, or -1 if nothing's waiting
+static int batch_timeout_ms()
+{
+    int timeout_ms = -1;
+    int now_us = microsecs();
+    for (int i = 0; i < 2; i++) {
+        if (batches[i].len == 0)
+            continue;
+
+        int wait_us = batches[i].start_us + batch_usecs - now_us;
+        int wait_ms = wait_us > 0 ? (wait_us + 999) / 1000 : 0;
+        if (timeout_ms < 0 || wait_ms < timeout_ms)
+            timeout_ms = wait_ms;
+    }
+    return timeout_ms;
+}
+
+static int send_due_batches()
+{
+    int now_us = microsecs();
+    for (int i = 0; i < 2; i++) {
+        if (batches[i].len > 0 && now_us - batches[i].start_us >= batch_usecs &&
+            send_batch(&batches[i]) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int open_output_file(int truncate)
+{
+    // Not O_APPEND since splice(2) can't write to files opened that way
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+    output_file_fd = open(output_file_path, flags, 0644);
+    if (output_file_fd < 0)
+        return -1;
+
+    output_file_size = lseek(output_file_fd, 0, SEEK_END);
+    if (output_file_size < 0)
+        output_file_size = 0;
+    return 0;
+}
+
+// Shift <path>.1 to <path>.2 and so on, dropping the oldest, and then start
+// a new file.
+static int rotate_output_file()
+{
+    INFO("rotating %s at %lld bytes", output_file_path, (long long) output_file_size);
+    close(output_file_fd);
+    output_file_fd = -1;
+
+    for (int i = output_file_keep; i > 0; i--) {
+        char *from;
+        char *to;
+        if (i == 1)
+            from = strdup(output_file_path);
+        else
+            checked_asprintf(&from, "%s.%d", output_file_path, i - 1);
+        checked_asprintf(&to, "%s.%d", output_file_path, i);
+
+        if (rename(from, to) < 0 && errno != ENOENT)
+            WARN("rename %s", from);
+        free(from);
+        free(to);
+    }
+
+    if (open_output_file(1) < 0) {
+        WARN("open %s", output_file_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Return how much can go in the output file before it has to be rotated
+static int output_file_room(size_t wanted, size_t *room)
+{
+    if (output_file_max_bytes > 0 && output_file_size >= output_file_max_bytes &&
+        rotate_output_file() < 0)
+        return -1;
+
+    *room = wanted;
+    if (output_file_max_bytes > 0 && (off_t) wanted > output_file_max_bytes - output_file_size)
+        *room = output_file_max_bytes - output_file_size;
+    return 0;
+}
+
+static int write_output_file(const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        size_t amount;
+        if (output_file_room(len, &amount) < 0 ||
+            write_all(output_file_fd, data, amount) < 0)
+            return -1;
+
+        output_file_size += amount;
+        data += amount;
+        len -= amount;
+    }
+    return 0;
+}
+
+#if defined(__linux__)
+// Move what's in the pipe straight into the output file
+static int splice_to_file(int from_fd)
+{
+    int available;
+    if (ioctl(from_fd, FIONREAD, &available) < 0) {
+        WARN("ioctl(FIONREAD)");
+        return -1;
+    }
+
+    // Readable with nothing to read is EOF
+    if (available == 0)
+        return 1;
+
+    size_t amount;
+    if (output_file_room(available, &amount) < 0)
+        return -1;
+
+    ssize_t written;
+    do {
+        written = splice(from_fd, NULL, output_file_fd, NULL, amount, SPLICE_F_MOVE);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) {
+        WARN("failed to splice to %s", output_file_path);
+        return -1;
+    }
+
+    output_file_size += written;
+    return 0;
+}
+#endif
+
+// Captured output that doesn't go to Erlang goes to the output file and/or
+// the tail. When output is only captured for the tail, that includes stderr
+// from --capture-stderr, which would go to /dev/null without a tail. Stderr
+// from --separate-stderr was asked for, so it's still sent.
+static int output_to_erlang(int from_fd)
+{
+    if (output_file_fd >= 0)
+        return output_packet_type(from_fd) != PACKET_OUTPUT;
+
+    return !(tail_only && (from_fd == stdout_pipe[0] || !separate_stderr));
+}
+
+static int sink_stdio(int from_fd)
+{
+#if defined(__linux__)
+    if (output_file_fd >= 0 && tail_bytes == 0)
+        return splice_to_file(from_fd);
+#endif
+
+    uint8_t buff[4096];
+    ssize_t got = read(from_fd, buff, sizeof(buff));
+    if (got == 0)
+        return 1;
+
+    if (got < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+
+        WARN("failed to read stdio");
+        return -1;
+    }
+
+    record_tail(buff, got);
+    if (output_file_fd >= 0 && write_output_file(buff, got) < 0)
+        return -1;
+    return 0;
+}
+
+static int send_line(struct line_framer *lines, uint8_t flags)
+{
+    lines->buffer[0] = flags;
+    stdio_bytes_avail -= lines->len + 1;
+    int rc = send_packet(PACKET_LINE, lines->buffer, lines->len + 1);
+    lines->len = 0;
+    return rc;
+}
+
+static uint8_t line_flags(int is_stderr)
+{
+    return separate_stderr && is_stderr ? LINE_FLAG_STDERR : 0;
+}
+
+// Read output and send each complete line in its own packet. A line costs
+// its length plus one against the stdio window so that empty lines are
+// acknowledged too.
+static int frame_lines(int from_fd)
+{
+    int is_stderr = from_fd == stderr_pipe[0];
+    struct line_framer *lines = is_stderr ? &stderr_lines : &stdout_lines;
+    uint8_t flags = line_flags(is_stderr);
+
+    size_t max_to_read = stdio_bytes_avail > 4096 ? 4096 : stdio_bytes_avail;
+    char buff[max_to_read];
+    ssize_t got = read(from_fd, buff, max_to_read);
+    if (got < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+
+        WARN("failed to read stdio");
+        return -1;
+    }
+
+    if (got > 0)
+        record_tail(buff, got);
+
+    if (got == 0)
+        return 1;
+
+    const char *p = buff;
+    const char *end = buff + got;
+    while (p < end) {
+        const char *newline = memchr(p, '\n', end - p);
+        size_t amount = (newline ? newline : end) - p;
+
+        if (!lines->discarding) {
+            size_t room = line_max - lines->len;
+            if (amount > room) {
+                memcpy(lines->buffer + 1 + lines->len, p, room);
+                lines->len += room;
+                if (send_line(lines, flags | LINE_FLAG_TRUNCATED) < 0)
+                    return -1;
+                lines->discarding = 1;
+            } else {
+                memcpy(lines->buffer + 1 + lines->len, p, amount);
+                lines->len += amount;
+            }
+        }
+
+        if (!newline)
+            break;
+
+        if (lines->discarding)
+            lines->discarding = 0;
+        else if (send_line(lines, flags) < 0)
+            return -1;
+
+        p = newline + 1;
+    }
+    return 0;
+}
+
+// Stop watching a stdio pipe and close it. A framed pipe's last line is sent
+// even though it didn't end with a newline. This is the only place that sends
+// it since the pipe may be closed before its EOF is read.
+static int close_stdio_pipe(int *read_end)
+{
+    int is_stderr = read_end == &stderr_pipe[0];
+    struct line_framer *lines = is_stderr ? &stderr_lines : &stdout_lines;
+
+    ev_remove(*read_end);
+    close_pipe_end(read_end);
+
+    lines->discarding = 0;
+    if (line_max > 0 && lines->len > 0)
+        return send_line(lines, line_flags(is_stderr));
+    return 0;
+}
+
+static int process_stdio(int from_fd)
+{
+    if (!output_to_erlang(from_fd))
+        return sink_stdio(from_fd);
+
+    if (stdio_bytes_avail <= 0)
+        return 0;
+
+    if (line_max > 0)
+        return frame_lines(from_fd);
+
+    if (batch_bytes > 0)
+        return batch_stdio(from_fd);
+
+#if defined(__linux__)
+    if (tail_bytes == 0)
+        return forward_stdio(from_fd);
+#endif
+    return copy_stdio(from_fd);
+}
+
+// Read from Erlang. Returns the number of bytes read, 0 if nothing was
+// available, or -1 on EOF or error.
+static ssize_t read_from_erlang(void *buf, size_t len)
+{
+    ssize_t amt = read(STDIN_FILENO, buf, len);
+    if (amt > 0)
+        return amt;
+
+    if (amt == 0) {
+        INFO("eof on STDIN_FILENO");
+        return -1;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        INFO("read STDIN_FILENO error: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Note when captured output has used up the window so that the time until
+// Erlang reopens it can be measured. Timing starts from when the last output
+// was sent since writes block when Erlang is slow to read them.
+static void check_stdio_stall(int sent_us)
+{
+    if (stdio_bytes_avail <= 0 && !stdio_stalled) {
+        stdio_stalled = 1;
+        stdio_stall_start_us = sent_us;
+    }
+}
+
+static int set_stdio_window(int new_max)
+{
+    INFO("stdio window %d -> %d", stdio_bytes_max, new_max);
+
+    // Bytes in flight stay in flight, so a shrink can leave no room until
+    // enough acks come back.
+    stdio_bytes_avail += new_max - stdio_bytes_max;
+    stdio_bytes_max = new_max;
+
+    if (protocol_version == PROTOCOL_V2) {
+        uint8_t payload[4];
+        put_be32(payload, (uint32_t) new_max);
+        return send_packet(PACKET_WINDOW, payload, sizeof(payload));
+    }
+    return 0;
+}
+
+static int adapt_stdio_window(int stall_us)
+{
+    int new_max = stdio_bytes_max;
+
+    if (stall_us < ADAPT_GROW_STALL_US)
+        new_max = stdio_bytes_max > stdio_window_max / 2 ? stdio_window_max : stdio_bytes_max * 2;
+    else if (stall_us > ADAPT_SHRINK_STALL_US)
+        new_max = stdio_bytes_max / 2 < stdio_window_min ? stdio_window_min : stdio_bytes_max / 2;
+
+    if (new_max == stdio_bytes_max)
+        return 0;
+
+    return set_stdio_window(new_max);
+}
+
+static int add_acks(uint32_t count)
+{
+    if (count > (uint32_t) stdio_bytes_max ||
+        stdio_bytes_avail + (int) count > stdio_bytes_max) {
+        WARNX("Too many acks %d/%d, got %u", (int) stdio_bytes_avail, (int) stdio_bytes_max, count);
+        return -1;
+    }
+
+    stdio_bytes_avail += count;
+
+    if (stdio_stalled && stdio_bytes_avail > 0) {
+        stdio_stalled = 0;
+        if (stdio_window_max > 0)
+            return adapt_stdio_window(microsecs() - stdio_stall_start_us);
+    }
+    return 0;
+}
+
+static int send_stdin_credit(size_t count)
+{
+    uint8_t payload[4];
+    put_be32(payload, (uint32_t) count);
+    return send_packet(PACKET_STDIN_CREDIT, payload, sizeof(payload));
+}
+
+static int buffer_child_stdin(const uint8_t *data, size_t len)
+{
+    if (!forward_stdin || stdin_eof_requested) {
+        WARNX("unexpected stdin data");
+        return -1;
+    }
+    if (len == 0)
+        return 0;
+    if (stdin_buffer_len + len > DEFAULT_STDIN_WINDOW) {
+        WARNX("stdin data exceeds credit (%d buffered, got %d)", (int) stdin_buffer_len, (int) len);
+        return -1;
+    }
+
+    // The child already closed its stdin, so drop the data
+    if (stdin_pipe[1] < 0)
+        return send_stdin_credit(len);
+
+    if (stdin_buffer_start + stdin_buffer_len + len > DEFAULT_STDIN_WINDOW) {
+        memmove(stdin_buffer, stdin_buffer + stdin_buffer_start, stdin_buffer_len);
+        stdin_buffer_start = 0;
+    }
+    memcpy(stdin_buffer + stdin_buffer_start + stdin_buffer_len, data, len);
+    stdin_buffer_len += len;
+    return 0;
+}
+
+static int handle_packet(const uint8_t *packet, size_t len)
+{
+    if (len == 0) {
+        WARNX("empty packet");
+        return -1;
+    }
+
+    switch (packet[0]) {
+    case PACKET_ACK:
+        if (len != 5) {
+            WARNX("bad ack packet length %d", (int) len);
+            return -1;
+        }
+        return add_acks(get_be32(&packet[1]));
+
+    case PACKET_STDIN:
+        return buffer_child_stdin(&packet[1], len - 1);
+
+    case PACKET_STDIN_EOF:
+        if (!forward_stdin) {
+            WARNX("stdin eof without --forward-stdin");
+            return -1;
+        }
+        stdin_eof_requested = 1;
+        return 0;
+
+    default:
+        WARNX("unexpected packet type %d", packet[0]);
+        return -1;
+    }
+}
+
+static int process_packets()
+{
+    ssize_t amt = read_from_erlang(packet_buffer + packet_buffer_len,
+                                   sizeof(packet_buffer) - packet_buffer_len);
+    if (amt <= 0)
+        return (int) amt;
+
+    packet_buffer_len += amt;
+
+    size_t offset = 0;
+    while (packet_buffer_len - offset >= 4) {
+        uint32_t len = get_be32(&packet_buffer[offset]);
+        if (len > sizeof(packet_buffer) - 4) {
+            WARNX("packet too large (%u bytes)", len);
+            return -1;
+        }
+        if (packet_buffer_len - offset - 4 < len)
+            break;
+
+        if (handle_packet(&packet_buffer[offset + 4], len) < 0)
+            return -1;
+        offset += 4 + len;
+    }
+
+    packet_buffer_len -= offset;
+    memmove(packet_buffer, packet_buffer + offset, packet_buffer_len);
+    return 0;
+}
+
+// Process acknowledgments from Erlang for captured output. Returns -1 on
+// EOF, a read error, or more acks than bytes sent.
+static int process_acks()
+{
+    if (protocol_version == PROTOCOL_V2)
+        return process_packets();
+
+    uint8_t acknowledgments[32];
+    ssize_t amt = read_from_erlang(acknowledgments, sizeof(acknowledgments));
+    if (amt <= 0)
+        return (int) amt;
+
+    // More than one acknowledgment may have come in, so process them all.
+    // NOTE: each ack is 1+its_value
+    uint32_t total_acks = amt;
+    for (ssize_t i = 0; i < amt; i++)
+        total_acks += acknowledgments[i];
+
+    return add_acks(total_acks);
+}
+
+// Wait for Erlang to acknowledge all captured output before exiting. Exiting
+// with acks in flight makes the Erlang-side write fail with EPIPE, and the
+// port kills the process that ran the command with reason :epipe.
+static void wait_for_acks()
+{
+    struct pollfd fds[1];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+
+    while (stdio_bytes_avail < stdio_bytes_max) {
+        int rc = poll(fds, 1, ACK_WAIT_TIMEOUT_MS);
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc <= 0) {
+            // Erlang should have acknowledged by now, so give up rather than hang.
+            WARNX("gave up waiting for acks (%d/%d)", (int) stdio_bytes_avail, (int) stdio_bytes_max);
+            return;
         }
 
         if (fds[0].revents & POLLHUP) {
-            // Erlang signals that it's done by closing stdin. Exit immediately.
-            INFO("stdin closed. Exiting...");
-            return EXIT_FAILURE;
+            // Erlang closed the port, so no more acks are coming.
+            return;
         }
 
-        if (fds[0].revents & POLLIN) {
-            if (process_acks() < 0)
-                return EXIT_FAILURE;
+        if (process_acks() < 0)
+            return;
+    }
+}
+
+// Only read output for Erlang while it has room for more. Output for the file
+// or tail is always read.
+static void update_stdio_interest()
+{
+    int interest = stdio_bytes_avail > 0 ? EV_READ : 0;
+    if (stdout_pipe[0] >= 0)
+        (void) ev_modify(stdout_pipe[0], output_to_erlang(stdout_pipe[0]) ? interest : EV_READ);
+    if (stderr_pipe[0] >= 0)
+        (void) ev_modify(stderr_pipe[0], output_to_erlang(stderr_pipe[0]) ? interest : EV_READ);
+}
+
+// Write buffered stdin data to the child and return the credit to Erlang
+static int write_child_stdin()
+{
+    ssize_t written = write(stdin_pipe[1], stdin_buffer + stdin_buffer_start, stdin_buffer_len);
+    if (written < 0) {
+        if (errno == EINTR || errno == EAGAIN)
+            return 0;
+
+        if (errno != EPIPE) {
+            WARN("write child stdin");
+            return -1;
         }
 
-        if (poll_num > 2 && fds[2].revents) {
-            if (process_stdio(fds[2].fd) < 0)
-                return EXIT_FAILURE;
+        // The child closed its stdin. Drop what it won't read.
+        INFO("child closed stdin");
+        ev_remove(stdin_pipe[1]);
+        close_pipe_end(&stdin_pipe[1]);
+        written = stdin_buffer_len;
+    }
+
+    stdin_buffer_start += written;
+    stdin_buffer_len -= written;
+    if (stdin_buffer_len == 0)
+        stdin_buffer_start = 0;
+
+    return send_stdin_credit(written);
+}
+
+// Only wait for the child's stdin to be writable when there's something to
+// write. Close it once Erlang is done and everything has been written.
+static void update_child_stdin_interest()
+{
+    if (stdin_pipe[1] < 0)
+        return;
+
+    if (stdin_buffer_len > 0) {
+        (void) ev_modify(stdin_pipe[1], EV_WRITE);
+    } else if (stdin_eof_requested) {
+        INFO("closing child stdin");
+        ev_remove(stdin_pipe[1]);
+        close_pipe_end(&stdin_pipe[1]);
+    } else {
+        (void) ev_modify(stdin_pipe[1], 0);
+    }
+}
+
+// Once the child exits, only forward the output that it left in the pipe. A
+// descendant that inherited the pipe could keep writing to it forever, so
+// move what's there now into a private pipe and close the shared one. The
+// private pipe reaches EOF once it has been drained.
+static int detach_stdio_pipe(int *read_end)
+{
+    if (*read_end < 0)
+        return 0;
+
+    int available;
+    int private_pipe[2];
+    if (ioctl(*read_end, FIONREAD, &available) < 0 || pipe(private_pipe) < 0) {
+        WARN("can't save the child's remaining output");
+        return close_stdio_pipe(read_end);
+    }
+
+#if defined(F_GETPIPE_SZ) && defined(F_SETPIPE_SZ)
+    int size = fcntl(*read_end, F_GETPIPE_SZ);
+    if (size > 0)
+        (void) fcntl(private_pipe[1], F_SETPIPE_SZ, size);
+#endif
+    (void) fcntl(private_pipe[1], F_SETFL, O_NONBLOCK);
+
+    INFO("saving %d bytes left by the child on fd %d", available, *read_end);
+    char buff[4096];
+    while (available > 0) {
+        size_t amount = (size_t) available < sizeof(buff) ? (size_t) available : sizeof(buff);
+        ssize_t got = read(*read_end, buff, amount);
+        if (got <= 0) {
+            if (got < 0 && errno == EINTR)
+                continue;
+            break;
         }
 
-        if (poll_num > 3 && fds[3].revents) {
-            if (process_stdio(fds[3].fd) < 0)
-                return EXIT_FAILURE;
+        if (write_all(private_pipe[1], buff, got) < 0) {
+            WARN("dropping output left by the child");
+            break;
+        }
+        available -= got;
+    }
+
+    ev_remove(*read_end);
+    close_pipe_end(read_end);
+    close(private_pipe[1]);
+
+    *read_end = private_pipe[0];
+    return ev_add(*read_end, EV_TAG_STDIO, 0);
+}
+
+// Check for output that the child left in the pipes when it exited. A pipe
+// with nothing ready is at EOF, so stop watching it. Returns 1 if there's
+// more to forward and -1 on error.
+static int stdio_pending()
+{
+    int *read_ends[2] = { &stdout_pipe[0], &stderr_pipe[0] };
+    int pending = 0;
+    for (int i = 0; i < 2; i++) {
+        if (*read_ends[i] < 0)
+            continue;
+
+        struct pollfd fds[1];
+        fds[0].fd = *read_ends[i];
+        fds[0].events = POLLIN;
+        if (poll(fds, 1, 0) > 0 && (fds[0].revents & POLLIN)) {
+            pending = 1;
+        } else if (close_stdio_pipe(read_ends[i]) < 0) {
+            return -1;
         }
+    }
+    return pending;
+}
+
+static int child_wait_loop(pid_t child_pid, int *still_running)
+{
+    if (ev_add(STDIN_FILENO, EV_TAG_ACKS, EV_READ) < 0 ||
+        ev_add(signal_fd, EV_TAG_SIGNAL, EV_READ) < 0 ||
+        (child_pidfd >= 0 && ev_add(child_pidfd, EV_TAG_CHILD, EV_READ) < 0) ||
+        (stdout_pipe[0] >= 0 && ev_add(stdout_pipe[0], EV_TAG_STDIO, 0) < 0) ||
+        (stderr_pipe[0] >= 0 && ev_add(stderr_pipe[0], EV_TAG_STDIO, 0) < 0) ||
+        (stdin_pipe[1] >= 0 && ev_add(stdin_pipe[1], EV_TAG_CHILD_STDIN, 0) < 0))
+        return EXIT_FAILURE;
+
+    for (int i = 0; i < pressure_trigger_count; i++) {
+        if (ev_add(pressure_triggers[i].fd, EV_TAG_PRESSURE, EV_PRI) < 0)
+            return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < EVENT_FILE_COUNT; i++) {
+        if (event_fds[i] >= 0 && ev_add(event_fds[i], EV_TAG_CGROUP_EVENTS, EV_PRI) < 0)
+            return EXIT_FAILURE;
+    }
 
-        if (fds[1].revents) {
-            int signal;
-            ssize_t amt = read(signal_pipe[0], &signal, sizeof(signal));
-            if (amt < 0) {
-                WARN("read signal_pipe");
+    struct ev_event events[EV_MAX_SOURCES];
+    int exit_status = EXIT_FAILURE;
+    for (;;) {
+        // Finish forwarding the child's output before returning its status
+        if (!*still_running) {
+            int pending = stdio_pending();
+            if (pending < 0)
                 return EXIT_FAILURE;
+            if (!pending)
+                return send_all_batches() < 0 ? EXIT_FAILURE : exit_status;
+        }
+
+        update_stdio_interest();
+        update_child_stdin_interest();
+
+        int stats_ms = stats_timeout_ms();
+        int batch_ms = batch_timeout_ms();
+        int timeout_ms = stats_ms < 0 || (batch_ms >= 0 && batch_ms < stats_ms) ? batch_ms : stats_ms;
+        int count = ev_wait(events, EV_MAX_SOURCES, timeout_ms);
+        if (count < 0)
+            return EXIT_FAILURE;
+
+        if (batch_ms >= 0 && send_due_batches() < 0)
+            return EXIT_FAILURE;
+
+        if (stats_timeout_ms() == 0 && sample_stats() < 0)
+            return EXIT_FAILURE;
+
+        int signal_ready = 0;
+        int child_ready = 0;
+        for (int i = 0; i < count; i++) {
+            struct ev_event *event = &events[i];
+            switch (event->tag) {
+            case EV_TAG_ACKS:
+                if (event->events & EV_HUP) {
+                    // Erlang signals that it's done by closing stdin. Exit immediately.
+                    INFO("stdin closed. Exiting...");
+                    return EXIT_FAILURE;
+                }
+
+                if (process_acks() < 0)
+                    return EXIT_FAILURE;
+                break;
+
+            case EV_TAG_STDIO: {
+                int sent_us = microsecs();
+                int rc = process_stdio(event->fd);
+                if (rc < 0)
+                    return EXIT_FAILURE;
+
+                check_stdio_stall(sent_us);
+
+                if (rc > 0) {
+                    // The child closed its end, so stop watching it.
+                    INFO("eof on stdio fd %d", event->fd);
+                    if (close_stdio_pipe(event->fd == stdout_pipe[0] ? &stdout_pipe[0] : &stderr_pipe[0]) < 0)
+                        return EXIT_FAILURE;
+                }
+                break;
             }
 
-            switch (signal) {
-            case SIGCHLD: {
-                int status;
-                pid_t dying_pid = wait(&status);
-                if (dying_pid == child_pid) {
-                    // Let the caller know that the child isn't running and has been cleaned up
-                    *still_running = 0;
-
-                    int exit_status;
-                    if (WIFSIGNALED(status)) {
-                        // Crash on signal, return the signal in the exit status. See POSIX:
-                        // http://pubs.opengroup.org/onlinepubs/9699919799/utilities/V3_chap02.html#tag_18_08_02
-                        exit_status = 128 + WTERMSIG(status);
-                        INFO("child terminated via signal %d. our exit status: %d", status, exit_status);
-                    } else if (WIFEXITED(status)) {
-                        exit_status = WEXITSTATUS(status);
-                        INFO("child exited with exit status: %d", exit_status);
-                    } else {
-                        INFO("child terminated with unexpected status: %d", status);
-                        exit_status = EXIT_FAILURE;
-                    }
-                    return exit_status;
-                } else {
-                    INFO("something else caused sigchild: pid=%d, status=%d. our child=%d", dying_pid, status, child_pid);
+            case EV_TAG_CHILD_STDIN:
+                if (write_child_stdin() < 0)
+                    return EXIT_FAILURE;
+                break;
+
+            case EV_TAG_PRESSURE:
+                if (event->events & EV_ERR) {
+                    // The trigger was destroyed along with its cgroup
+                    ev_remove(event->fd);
+                } else if ((event->events & EV_PRI) && send_pressure(event->fd) < 0) {
+                    return EXIT_FAILURE;
                 }
                 break;
+
+            case EV_TAG_CGROUP_EVENTS:
+                // Changes are reported with POLLPRI and POLLERR together
+                if ((event->events & EV_PRI) && send_events(event->fd) < 0)
+                    return EXIT_FAILURE;
+                break;
+
+            case EV_TAG_SIGNAL:
+                signal_ready = 1;
+                break;
+
+            case EV_TAG_CHILD:
+                child_ready = 1;
+                break;
             }
+        }
+
+        // Handle signals and the child exiting after output so that output
+        // that was ready is forwarded first.
+        if (signal_ready) {
+            int signal = read_signal();
+            switch (signal) {
+            case SIGCHLD:
+                child_ready = 1;
+                break;
 
             case SIGTERM:
             case SIGQUIT:
@@ -882,6 +2902,23 @@ static int child_wait_loop(pid_t child_pid, int *still_running)
                 return EXIT_FAILURE;
             }
         }
+
+        if (child_ready && *still_running) {
+            int rc = reap_child(child_pid, &exit_status);
+            if (rc < 0)
+                return EXIT_FAILURE;
+
+            if (rc > 0) {
+                // Let the caller know that the child isn't running and has been cleaned up
+                *still_running = 0;
+                if (child_pidfd >= 0)
+                    ev_remove(child_pidfd);
+
+                if (detach_stdio_pipe(&stdout_pipe[0]) < 0 ||
+                    detach_stdio_pipe(&stderr_pipe[0]) < 0)
+                    return EXIT_FAILURE;
+            }
+        }
     }
 }
 
@@ -946,6 +2983,14 @@ int main(int argc, char *argv[])
             stdio_bytes_avail = stdio_bytes_max;
             break;
 
+        case 'm': // --stdio-window-min
+            stdio_window_min = strtol(optarg, NULL, 0);
+            break;
+
+        case 'M': // --stdio-window-max
+            stdio_window_max = strtol(optarg, NULL, 0);
+            break;
+
         case 'o': // --capture-output
             capture_output = 1;
             break;
@@ -958,6 +3003,88 @@ int main(int argc, char *argv[])
             capture_stderr_only = 1;
             break;
 
+        case 'S': // --separate-stderr
+            separate_stderr = 1;
+            break;
+
+        case 'L': // --line-max
+            line_max = strtoul(optarg, NULL, 0);
+            if (line_max == 0)
+                FATALX("--line-max must be greater than 0");
+            break;
+
+        case 'i': // --forward-stdin
+            forward_stdin = 1;
+            break;
+
+        case 'R': // --reuse-group
+            reuse_cgroup = 1;
+            break;
+
+        case 'f': // --output-file
+            output_file_path = optarg;
+            break;
+
+        case 'b': // --output-file-max-bytes
+            output_file_max_bytes = strtoll(optarg, NULL, 0);
+            if (output_file_max_bytes <= 0)
+                FATALX("--output-file-max-bytes must be greater than 0");
+            break;
+
+        case 'K': // --output-file-keep
+            output_file_keep = strtol(optarg, NULL, 0);
+            if (output_file_keep < 0)
+                FATALX("--output-file-keep can't be negative");
+            break;
+
+        case 'I': // --stats-interval
+            stats_interval_ms = strtol(optarg, NULL, 0);
+            if (stats_interval_ms <= 0)
+                FATALX("--stats-interval must be greater than 0");
+            break;
+
+        case 'P': // --pressure-trigger
+            add_pressure_trigger(optarg);
+            break;
+
+        case 'Z': // --pipe-size
+            pipe_size = strtol(optarg, NULL, 0);
+            if (pipe_size <= 0)
+                FATALX("--pipe-size must be greater than 0");
+            break;
+
+        case 'B': // --batch-bytes
+            batch_bytes = strtoul(optarg, NULL, 0);
+            if (batch_bytes == 0 || batch_bytes > MAX_BATCH_BYTES)
+                FATALX("--batch-bytes must be between 1 and %d", MAX_BATCH_BYTES);
+            break;
+
+        case 'T': // --batch-usecs
+            batch_usecs = strtol(optarg, NULL, 0);
+            if (batch_usecs <= 0)
+                FATALX("--batch-usecs must be greater than 0");
+            break;
+
+        case 'E': // --cgroup-events
+            watch_cgroup_events = 1;
+            break;
+
+        case 'U': // --resource-usage
+            report_usage = 1;
+            break;
+
+        case 't': // --tail-bytes
+            tail_bytes = strtoul(optarg, NULL, 0);
+            if (tail_bytes == 0)
+                FATALX("--tail-bytes must be greater than 0");
+            break;
+
+        case 'p': // --protocol
+            protocol_version = strtol(optarg, NULL, 0);
+            if (protocol_version != PROTOCOL_V1 && protocol_version != PROTOCOL_V2)
+                FATALX("Unsupported protocol version '%s'", optarg);
+            break;
+
         case 's':
         {
             if (!current_controller)
@@ -1062,13 +3189,115 @@ int main(int argc, char *argv[])
     if (cgroup_path)
         finish_controller_init();
 
-    // Finished processing commandline. Initialize and run child.
+    if (output_file_path) {
+        if (open_output_file(0) < 0)
+            FATAL("Can't open '%s'", output_file_path);
 
-    if (pipe(signal_pipe) < 0)
-        FATAL("pipe");
-    if (fcntl(signal_pipe[0], F_SETFD, FD_CLOEXEC) < 0 ||
-        fcntl(signal_pipe[1], F_SETFD, FD_CLOEXEC) < 0)
-        WARN("fcntl(FD_CLOEXEC)");
+        // Capture stdout for the file when nothing else asked for it
+        if (!capture_output && !capture_stderr_only)
+            capture_output = 1;
+    } else if (output_file_max_bytes > 0) {
+        FATALX("Specify --output-file with --output-file-max-bytes");
+    }
+
+    if (stats_interval_ms > 0) {
+        if (protocol_version != PROTOCOL_V2)
+            FATALX("--stats-interval requires --protocol 2");
+        if (!cgroup_path)
+            FATALX("--stats-interval requires a cgroup (-g)");
+    }
+
+    if (batch_bytes > 0) {
+        for (int i = 0; i < 2; i++) {
+            batches[i].buffer = malloc(batch_bytes);
+            if (!batches[i].buffer)
+                FATAL("malloc");
+        }
+    }
+
+    if (watch_cgroup_events) {
+        if (protocol_version != PROTOCOL_V2)
+            FATALX("--cgroup-events requires --protocol 2");
+        if (!cgroup_path)
+            FATALX("--cgroup-events requires a cgroup (-g)");
+    }
+
+    if (pressure_trigger_count > 0) {
+        if (protocol_version != PROTOCOL_V2)
+            FATALX("--pressure-trigger requires --protocol 2");
+        if (!cgroup_path)
+            FATALX("--pressure-trigger requires a cgroup (-g)");
+    }
+
+    if (report_usage) {
+        if (protocol_version != PROTOCOL_V2)
+            FATALX("--resource-usage requires --protocol 2");
+
+        // Erlang may have closed the port by the time the usage is sent
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    if (tail_bytes > 0) {
+        if (protocol_version != PROTOCOL_V2)
+            FATALX("--tail-bytes requires --protocol 2");
+
+        // Capture stdout for the tail, but don't send it
+        if (!capture_output && !capture_stderr_only) {
+            capture_output = 1;
+            tail_only = 1;
+        }
+
+        tail_buffer = malloc(tail_bytes);
+        if (!tail_buffer)
+            FATAL("malloc");
+
+        // Erlang may have closed the port by the time the tail is sent
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    if (separate_stderr) {
+        if (protocol_version != PROTOCOL_V2)
+            FATALX("--separate-stderr requires --protocol 2");
+
+        // Stderr always gets its own pipe. Stdout is only captured if asked.
+        if (capture_output)
+            capture_stderr = 1;
+        else
+            capture_stderr_only = 1;
+    }
+
+    if (stdio_window_max > 0) {
+        if (stdio_window_min < 16)
+            stdio_window_min = 16;
+        if (stdio_window_max < stdio_window_min)
+            FATALX("--stdio-window-max must be at least --stdio-window-min");
+
+        // Start from --stdio-window, but keep it within the bounds
+        if (stdio_bytes_max < stdio_window_min)
+            stdio_bytes_max = stdio_window_min;
+        else if (stdio_bytes_max > stdio_window_max)
+            stdio_bytes_max = stdio_window_max;
+        stdio_bytes_avail = stdio_bytes_max;
+    } else if (stdio_window_min > 0) {
+        FATALX("Specify --stdio-window-max with --stdio-window-min");
+    }
+
+    if (line_max > 0) {
+        if (protocol_version != PROTOCOL_V2)
+            FATALX("--line-max requires --protocol 2");
+
+        // A line has to fit in the window or it could never be acknowledged
+        int smallest_window = stdio_window_max > 0 ? stdio_window_min : stdio_bytes_max;
+        if (line_max + 1 > (size_t) smallest_window)
+            FATALX("--line-max must be less than the stdio window");
+
+        stdout_lines.buffer = malloc(line_max + 1);
+        stderr_lines.buffer = malloc(line_max + 1);
+        if (!stdout_lines.buffer || !stderr_lines.buffer)
+            FATAL("malloc");
+    }
+
+    // Finished processing commandline. Initialize and run child.
 
     if (capture_stderr_only) {
         // Only capturing stderr, create stderr pipe
@@ -1093,19 +3322,75 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (pipe_size > 0) {
+        set_pipe_size(stdout_pipe[0]);
+        set_pipe_size(stderr_pipe[0]);
+        set_pipe_size(STDOUT_FILENO);
+    }
+
+    if (forward_stdin) {
+        if (protocol_version != PROTOCOL_V2)
+            FATALX("--forward-stdin requires --protocol 2");
+
+        if (pipe(stdin_pipe) < 0)
+            FATAL("pipe");
+        if (fcntl(stdin_pipe[0], F_SETFD, FD_CLOEXEC) < 0 ||
+            fcntl(stdin_pipe[1], F_SETFD, FD_CLOEXEC) < 0 ||
+            fcntl(stdin_pipe[1], F_SETFL, O_NONBLOCK) < 0)
+            WARN("fcntl(stdin_pipe)");
+
+        stdin_buffer = malloc(DEFAULT_STDIN_WINDOW);
+        if (!stdin_buffer)
+            FATAL("malloc");
+
+        // Find out that the child closed its stdin from EPIPE rather than
+        // getting killed.
+        signal(SIGPIPE, SIG_IGN);
+    }
+
     enable_signal_handlers();
+    ev_init();
 
     if (cgroup_path) {
-        create_cgroups();
-        enable_controllers();
-        verify_controllers_available();
-        update_cgroup_settings();
+        if (reuse_cgroup && lock_reused_cgroup() == 0) {
+            // An earlier muontrap set this cgroup up. Make sure that nothing
+            // it ran is still around and undo any settings that were changed
+            // while it ran.
+            if (cgroup_has_processes())
+                cleanup_all_children();
+            update_cgroup_settings();
+        } else {
+            create_cgroups();
+            if (reuse_cgroup && lock_reused_cgroup() < 0)
+                FATAL("Can't open '%s'", full_cgroup_path);
+            enable_controllers();
+            verify_controllers_available();
+            update_cgroup_settings();
+        }
+
+        if (stats_interval_ms > 0)
+            open_stat_files();
+        if (watch_cgroup_events)
+            open_event_files();
+        if (open_pressure_triggers() < 0) {
+            if (!reuse_cgroup)
+                destroy_cgroups();
+            FATAL("Can't set --pressure-trigger on '%s'", full_cgroup_path);
+        }
     }
 
     const char *program_name = argv[optind];
     if (argv0)
         argv[optind] = argv0;
     pid_t pid = fork_exec(program_name, &argv[optind]);
+    track_child(pid);
+
+    // Only the child writes to the stdio pipes. Dropping our copies of the
+    // write ends keeps the per-instance descriptor count down and lets EOF
+    // be seen if the child closes its output early.
+    close_pipe_end(&stdout_pipe[1]);
+    close_pipe_end(&stderr_pipe[1]);
+    close_pipe_end(&stdin_pipe[0]);
 
     int still_running = 1;
     int exit_status = child_wait_loop(pid, &still_running);
@@ -1115,13 +3400,27 @@ int main(int argc, char *argv[])
         kill_child_nicely(pid);
     }
 
+    if (report_usage)
+        add_rusage();
+
     // Cleanup all descendents if using cgroups
     if (cgroup_path) {
         cleanup_all_children();
-        destroy_cgroups();
+
+        // Reused cgroups have counts from earlier commands too
+        if (report_usage && !reuse_cgroup)
+            add_cgroup_usage();
+
+        if (!reuse_cgroup)
+            destroy_cgroups();
     }
     disable_signal_handlers();
 
+    if (report_usage)
+        (void) send_packet(PACKET_USAGE, usage_payload, usage_payload_len);
+    if (tail_bytes > 0)
+        (void) send_tail();
+
     wait_for_acks();
     exit(exit_status);
 }
@@ -0,0 +1,229 @@
+# SPDX-FileCopyrightText: 2025 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule MuonTrap.Batch do
+  @moduledoc """
+  Run many short commands concurrently
+
+  Calling `MuonTrap.cmd/3` from `Task.async_stream/3` works, but each call
+  validates its options and looks up its executable again, and each command
+  that uses `:cgroup_base` sets up a cgroup with the same settings.
+  `run/2` does that work once for the batch:
+
+  * options are validated once for each distinct command and options pair,
+    so a batch that runs the same program with different arguments looks it
+    up once
+  * with `:cgroup_base`, one cgroup is created for the batch and the
+    `:cgroup` settings are applied to it. The limits apply to all of the
+    batch's commands together. Each command still gets its own cgroup under
+    the batch's one so that it's cleaned up and measured separately. muontrap
+    creates, enables the controllers for and removes those for each command,
+    but it doesn't write the settings to them.
+
+  ```elixir
+  iex> MuonTrap.Batch.run([{"echo", ["a"]}, {"echo", ["b"]}, {"sh", ["-c", "exit 3"]}])
+  ...> |> Enum.map(fn {output, status, _usage} -> {output, status} end)
+  [{"a\\n", 0}, {"b\\n", 0}, {"", 3}]
+  ```
+
+  Run checksums with at most 4 at a time and with at most 512 MB of memory
+  between them:
+
+  ```elixir
+  MuonTrap.Batch.run(
+    Enum.map(paths, &{"sha256sum", [&1]}),
+    max_concurrency: 4,
+    cgroup_base: "muontrap",
+    cgroup: %{memory_max: 536_870_912}
+  )
+  ```
+  """
+
+  alias MuonTrap.Cgroups
+
+  require Logger
+
+  @batch_options [:max_concurrency, :cgroup_base, :cgroup]
+  @cgroup_options [:cgroup, :cgroup_path, :cgroup_base, :cgroup_pool]
+
+  # How long to keep trying to remove the batch's cgroup while muontrap
+  # finishes cleaning up the commands' cgroups
+  @rmdir_retry_ms 100
+  @rmdir_retries 50
+
+  @typedoc """
+  A command, its arguments and optionally `MuonTrap.cmd/3` options for it
+  """
+  @type command() :: {binary(), [binary()]} | {binary(), [binary()], keyword()}
+
+  @doc """
+  Run commands concurrently and return their results in order
+
+  Each result is the same as what `MuonTrap.cmd/3` returns with
+  `resource_usage: true`, so it's `{output, exit_status, resource_usage}`.
+
+  Options:
+
+  * `:max_concurrency` - how many commands to run at once. Defaults to
+    `System.schedulers_online/0`.
+  * `:cgroup_base` - create a cgroup for the batch under this one
+  * `:cgroup` - cgroup settings for the batch's cgroup. See `MuonTrap.cmd/3`
+    for the available settings. It needs at least one. `:cgroup_base` and
+    `:cgroup` go together.
+
+  All other options are passed to each `MuonTrap.cmd/3` call. Options given
+  with a command are merged over them. When the batch has a cgroup,
+  commands can't have cgroup options of their own.
+  """
+  @spec run([command()], keyword()) :: [
+          {Collectable.t() | {Collectable.t(), Collectable.t()},
+           exit_status :: non_neg_integer() | :timeout, resource_usage :: map()}
+        ]
+  def run(commands, opts \\ []) when is_list(commands) do
+    {batch_opts, cmd_opts} = Keyword.split(opts, @batch_options)
+    max_concurrency = Keyword.get(batch_opts, :max_concurrency, System.schedulers_online())
+    cgroup = batch_cgroup(batch_opts)
+
+    {options, _cache} =
+      commands
+      |> Enum.with_index()
+      |> Enum.map_reduce(%{}, &command_options(&1, &2, cmd_opts, cgroup))
+
+    create_cgroup(cgroup)
+
+    # The tasks aren't linked so that one that crashes doesn't take this
+    # process down before the batch's cgroup is removed
+    {:ok, supervisor} = Task.Supervisor.start_link()
+
+    try do
+      Task.Supervisor.async_stream_nolink(supervisor, options, &MuonTrap.Port.cmd/1,
+        max_concurrency: max_concurrency,
+        timeout: :infinity
+      )
+      |> Enum.map(fn
+        {:ok, result} -> result
+        {:exit, reason} -> exit(reason)
+      end)
+    after
+      # Stopping the supervisor kills any commands that are still running
+      Supervisor.stop(supervisor)
+      remove_cgroup(cgroup)
+    end
+  end
+
+  defp command_options({{command, args}, index}, cache, cmd_opts, cgroup),
+    do: command_options({{command, args, []}, index}, cache, cmd_opts, cgroup)
+
+  defp command_options({{command, args, opts}, index}, cache, cmd_opts, cgroup) do
+    if !Enum.all?(args, &is_binary/1) do
+      raise ArgumentError, "all arguments for MuonTrap.Batch.run/2 must be binaries"
+    end
+
+    key = {command, opts}
+
+    {options, cache} =
+      case cache do
+        %{^key => options} ->
+          {options, cache}
+
+        _ ->
+          options = validate(command, Keyword.merge(cmd_opts, opts), cgroup)
+          {options, Map.put(cache, key, options)}
+      end
+
+    {put_command_cgroup(%{options | args: args}, cgroup, index), cache}
+  end
+
+  defp validate(command, opts, nil) do
+    MuonTrap.Options.validate(:cmd, command, [], opts ++ [resource_usage: true])
+  end
+
+  defp validate(command, opts, cgroup) do
+    case Enum.find(opts, fn {key, _value} -> key in @cgroup_options end) do
+      {key, _value} ->
+        raise ArgumentError, "cannot specify a #{key} for a command in a batch with a cgroup"
+
+      nil ->
+        opts = [cgroup_path: cgroup.cgroup_path] ++ opts ++ [resource_usage: true]
+
+        MuonTrap.Options.validate(:cmd, command, [], opts)
+        |> Map.merge(%{cgroup_controllers: cgroup.cgroup_controllers, cgroup_sets: []})
+    end
+  end
+
+  # The commands' cgroups only need the controllers enabled. The limits are on
+  # the batch's cgroup.
+  defp put_command_cgroup(options, nil, _index), do: options
+
+  defp put_command_cgroup(options, cgroup, index),
+    do: %{options | cgroup_path: Path.join(cgroup.cgroup_path, Integer.to_string(index))}
+
+  defp batch_cgroup(batch_opts) do
+    case {Keyword.fetch(batch_opts, :cgroup_base), Keyword.fetch(batch_opts, :cgroup)} do
+      {{:ok, base}, {:ok, config}} ->
+        {controllers, sets} = Cgroups.translate_config(config)
+
+        # muontrap can't create a cgroup without a controller to enable in it
+        if controllers == [] do
+          raise ArgumentError, "the :cgroup configuration for MuonTrap.Batch.run/2 is empty"
+        end
+
+        %{
+          cgroup_path: Path.join(base, "batch-#{random_string()}"),
+          cgroup_controllers: controllers,
+          cgroup_sets: sets
+        }
+
+      {:error, :error} ->
+        nil
+
+      _ ->
+        raise ArgumentError, ":cgroup_base and :cgroup go together for MuonTrap.Batch.run/2"
+    end
+  end
+
+  defp create_cgroup(nil), do: :ok
+
+  defp create_cgroup(cgroup) do
+    # Running a command that does nothing sets up the cgroup and leaves it.
+    # This is the same as what MuonTrap.CgroupPool does.
+    options =
+      Map.merge(cgroup, %{
+        cmd: System.find_executable("true"),
+        args: [],
+        into: "",
+        reuse_cgroup: true
+      })
+
+    case MuonTrap.Port.cmd(options) do
+      {_, 0} ->
+        :ok
+
+      {_, status} ->
+        _ = Cgroups.rmdir(cgroup.cgroup_path)
+        raise "couldn't set up the cgroup #{cgroup.cgroup_path} (exit status #{status})"
+    end
+  end
+
+  defp remove_cgroup(nil), do: :ok
+  defp remove_cgroup(cgroup), do: remove_cgroup(cgroup.cgroup_path, @rmdir_retries)
+
+  defp remove_cgroup(path, retries) do
+    case Cgroups.rmdir(path) do
+      :ok ->
+        :ok
+
+      {:error, :ebusy} when retries > 0 ->
+        Process.sleep(@rmdir_retry_ms)
+        remove_cgroup(path, retries - 1)
+
+      {:error, reason} ->
+        Logger.warning("Couldn't remove the batch's cgroup #{path}: #{inspect(reason)}")
+    end
+  end
+
+  defp random_string() do
+    Integer.to_string(:rand.uniform(0x100000000), 36) |> String.downcase()
+  end
+end
@@ -0,0 +1,271 @@
+# SPDX-FileCopyrightText: 2025 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule MuonTrap.CgroupPool do
+  @moduledoc """
+  Keep configured cgroups around for commands to reuse
+
+  Running a command with `:cgroup_base` creates a cgroup, enables its
+  controllers, applies the `:cgroup` settings and then removes the cgroup
+  when the command exits. For short commands, that's a large part of the time
+  it takes to run them. A pool hands out cgroups that were set up by an
+  earlier command instead. They all have the same settings. Each command
+  writes them again when it starts. A cgroup that had something written to
+  it with `MuonTrap.Daemon.cgset/3` isn't reused at all since the pool can't
+  know how to undo it. It's removed when it's released and a new one takes
+  its place.
+
+  Start a pool under your supervision tree with the `:cgroup_base` and the
+  `:cgroup` settings that its commands should run with:
+
+  ```elixir
+  children = [
+    {MuonTrap.CgroupPool,
+     name: MyApp.CgroupPool, cgroup_base: "muontrap", cgroup: %{memory_max: 10_000_000}}
+  ]
+  ```
+
+  Then pass `cgroup_pool: MyApp.CgroupPool` to `MuonTrap.cmd/3` or
+  `MuonTrap.Daemon`. Commands that use a pool can't also pass `:cgroup`,
+  `:cgroup_path` or `:cgroup_base`.
+
+  Each command gets a cgroup to itself. The cgroup goes back to the pool
+  when `MuonTrap.cmd/3` returns or when the `MuonTrap.Daemon` exits. The
+  next command to get it waits for muontrap to kill anything left from the
+  previous one before it starts.
+
+  Options:
+
+  * `:cgroup_base` - the parent cgroup to create the pool's cgroups under
+  * `:cgroup` - the cgroup settings for the commands. See `MuonTrap.cmd/3`.
+    It needs at least one.
+  * `:size` - how many cgroups to set up when the pool starts. More are set
+    up as they're needed. Defaults to 0.
+  * `:name` - register the pool under this name
+  """
+  use GenServer
+
+  alias MuonTrap.Cgroups
+
+  require Logger
+
+  # How long to keep trying to remove a retired cgroup while muontrap
+  # finishes cleaning it up
+  @rmdir_retry_ms 100
+  @rmdir_retries 50
+
+  @type lease() :: %{
+          cgroup_path: String.t(),
+          cgroup_controllers: [String.t()],
+          cgroup_sets: [{String.t(), String.t(), String.t()}]
+        }
+
+  @doc """
+  Start a pool of cgroups
+  """
+  @spec start_link(keyword()) :: GenServer.on_start()
+  def start_link(opts) do
+    {genserver_opts, opts} = Keyword.split(opts, [:name])
+    GenServer.start_link(__MODULE__, opts, genserver_opts)
+  end
+
+  @doc """
+  Lease a cgroup
+
+  The cgroup is returned to the pool with `checkin/2` or when the calling
+  process exits.
+  """
+  @spec checkout(GenServer.server()) :: lease()
+  def checkout(pool) do
+    GenServer.call(pool, :checkout)
+  end
+
+  @doc """
+  Return a leased cgroup to the pool
+  """
+  @spec checkin(GenServer.server(), String.t()) :: :ok
+  def checkin(pool, cgroup_path) do
+    GenServer.call(pool, {:checkin, cgroup_path})
+  end
+
+  @doc """
+  Remove a leased cgroup once it's released rather than reusing it
+
+  `MuonTrap.Daemon.cgset/3` calls this for cgroups from a pool since the
+  pool only knows how to reset its own settings.
+  """
+  @spec retire(GenServer.server(), String.t()) :: :ok
+  def retire(pool, cgroup_path) do
+    GenServer.call(pool, {:retire, cgroup_path})
+  end
+
+  @doc """
+  Return the cgroup paths that aren't leased and the ones that are
+  """
+  @spec info(GenServer.server()) :: %{free: [String.t()], leased: [String.t()]}
+  def info(pool) do
+    GenServer.call(pool, :info)
+  end
+
+  @doc false
+  @spec checkout_options(MuonTrap.Options.t()) :: MuonTrap.Options.t()
+  def checkout_options(%{cgroup_pool: pool} = options) do
+    options
+    |> Map.merge(checkout(pool))
+    |> Map.put(:reuse_cgroup, true)
+  end
+
+  def checkout_options(options), do: options
+
+  @doc false
+  @spec checkin_options(MuonTrap.Options.t()) :: :ok
+  def checkin_options(%{cgroup_pool: pool, cgroup_path: cgroup_path}),
+    do: checkin(pool, cgroup_path)
+
+  def checkin_options(_options), do: :ok
+
+  @impl GenServer
+  def init(opts) do
+    base = Keyword.fetch!(opts, :cgroup_base)
+    {controllers, sets} = Cgroups.translate_config(Keyword.get(opts, :cgroup, %{}))
+
+    # muontrap can't create a cgroup without a controller to enable in it
+    if controllers == [] do
+      raise ArgumentError, "the :cgroup configuration for MuonTrap.CgroupPool is empty"
+    end
+
+    state = %{
+      base: base,
+      controllers: controllers,
+      sets: sets,
+      prefix: random_string(),
+      count: 0,
+      free: [],
+      leased: %{},
+      retired: MapSet.new()
+    }
+
+    # Remove the cgroups when the pool's supervisor stops it
+    Process.flag(:trap_exit, true)
+
+    {:ok, state, {:continue, {:warm, Keyword.get(opts, :size, 0)}}}
+  end
+
+  @impl GenServer
+  def handle_continue({:warm, size}, state) do
+    {paths, state} =
+      Enum.map_reduce(List.duplicate(nil, size), state, fn _, state -> new_path(state) end)
+
+    # Running a command that does nothing sets up the cgroup and leaves it
+    true_path = System.find_executable("true")
+
+    free =
+      Enum.filter(paths, fn path ->
+        options = %{cmd: true_path, args: [], into: "", reuse_cgroup: true}
+
+        case MuonTrap.Port.cmd(Map.merge(options, lease(state, path))) do
+          {_, 0} ->
+            true
+
+          {_, status} ->
+            Logger.warning("Couldn't set up the pooled cgroup #{path} (exit status #{status})")
+            _ = Cgroups.rmdir(path)
+            false
+        end
+      end)
+
+    {:noreply, %{state | free: free ++ state.free}}
+  end
+
+  @impl GenServer
+  def handle_call(:checkout, {pid, _tag}, state) do
+    {path, state} =
+      case state.free do
+        [path | rest] -> {path, %{state | free: rest}}
+        [] -> new_path(state)
+      end
+
+    ref = Process.monitor(pid)
+
+    {:reply, lease(state, path), %{state | leased: Map.put(state.leased, ref, path)}}
+  end
+
+  def handle_call({:checkin, path}, _from, state) do
+    case Enum.find(state.leased, fn {_ref, leased_path} -> leased_path == path end) do
+      {ref, _path} ->
+        Process.demonitor(ref, [:flush])
+        {:reply, :ok, release(state, ref)}
+
+      nil ->
+        {:reply, :ok, state}
+    end
+  end
+
+  def handle_call({:retire, path}, _from, state) do
+    if path in Map.values(state.leased) do
+      {:reply, :ok, %{state | retired: MapSet.put(state.retired, path)}}
+    else
+      {:reply, :ok, state}
+    end
+  end
+
+  def handle_call(:info, _from, state) do
+    {:reply, %{free: state.free, leased: Map.values(state.leased)}, state}
+  end
+
+  @impl GenServer
+  def handle_info({:DOWN, ref, :process, _pid, _reason}, state) do
+    {:noreply, release(state, ref)}
+  end
+
+  # muontrap may still be killing what the last command left in the cgroup
+  def handle_info({:remove, path, retries}, state) do
+    case Cgroups.rmdir(path) do
+      {:error, :ebusy} when retries > 0 ->
+        Process.send_after(self(), {:remove, path, retries - 1}, @rmdir_retry_ms)
+        {:noreply, state}
+
+      {:error, reason} ->
+        Logger.warning("Couldn't remove the retired cgroup #{path}: #{inspect(reason)}")
+        {:noreply, %{state | retired: MapSet.delete(state.retired, path)}}
+
+      :ok ->
+        {:noreply, %{state | retired: MapSet.delete(state.retired, path)}}
+    end
+  end
+
+  def handle_info(_message, state), do: {:noreply, state}
+
+  @impl GenServer
+  def terminate(_reason, state) do
+    # Removing a cgroup fails if processes are still in it, so any that are
+    # leased to running commands stay.
+    Enum.each(state.free ++ Map.values(state.leased), &Cgroups.rmdir/1)
+    Enum.each(state.retired, &Cgroups.rmdir/1)
+  end
+
+  defp release(state, ref) do
+    {path, leased} = Map.pop(state.leased, ref)
+
+    if path in state.retired do
+      send(self(), {:remove, path, @rmdir_retries})
+      %{state | leased: leased}
+    else
+      %{state | free: [path | state.free], leased: leased}
+    end
+  end
+
+  defp new_path(state) do
+    count = state.count + 1
+    {Path.join(state.base, "#{state.prefix}-#{count}"), %{state | count: count}}
+  end
+
+  defp lease(state, path) do
+    %{cgroup_path: path, cgroup_controllers: state.controllers, cgroup_sets: state.sets}
+  end
+
+  defp random_string() do
+    Integer.to_string(:rand.uniform(0x100000000), 36) |> String.downcase()
+  end
+end
@@ -56,6 +56,16 @@ defmodule MuonTrap.Cgroups do
     File.write(Path.join([@cgroup_fs, cgroup_path, variable_name]), value)
   end
 
+  @doc """
+  Remove a cgroup
+
+  This only works when there are no processes in it.
+  """
+  @spec rmdir(String.t()) :: :ok | {:error, File.posix()}
+  def rmdir(cgroup_path) do
+    File.rmdir(Path.join(@cgroup_fs, cgroup_path))
+  end
+
   # {map_key, file, type}. Map keys use underscores; the corresponding
   # interface file name is derived by replacing `_` with `.`.
   @config_fields [
@@ -241,74 +251,147 @@ defmodule MuonTrap.Cgroups do
     end)
   end
 
+  # Entries in the resource usage that muontrap sends when a command exits
+  @usage [
+    {"rusage", :flat_keyed},
+    {"cpu.stat", :flat_keyed},
+    {"memory.peak", :integer},
+    {"io.stat", :nested_keyed}
+  ]
+
+  @doc """
+  Parse the resource usage entries that muontrap sends when a command exits
+
+  `"rusage"` has the command's `getrusage(2)` counts. The rest are the
+  contents of cgroup interface files that were read just before the cgroup
+  was removed. They're parsed like `statistics/1` does.
+  """
+  @spec parse_usage([{String.t(), binary()}]) :: %{optional(String.t()) => term()}
+  def parse_usage(entries) do
+    Enum.reduce(@usage, %{}, fn {name, parser}, acc ->
+      with {_name, content} <- List.keyfind(entries, name, 0),
+           {:ok, value} <- parse(parser, content) do
+        Map.put(acc, name, value)
+      else
+        _ -> acc
+      end
+    end)
+  end
+
+  @doc """
+  Parse the contents of a PSI pressure file like `"memory.pressure"`
+  """
+  @spec parse_pressure(binary()) :: %{optional(String.t()) => map()}
+  def parse_pressure(content) do
+    case parse(:pressure, content) do
+      {:ok, pressure} -> pressure
+      :error -> %{}
+    end
+  end
+
+  @doc """
+  Parse the contents of a flat-keyed file like `"memory.events"`
+  """
+  @spec parse_flat_keyed(binary()) :: %{optional(String.t()) => integer()}
+  def parse_flat_keyed(content) do
+    case parse(:flat_keyed, content) do
+      {:ok, counts} -> counts
+      :error -> %{}
+    end
+  end
+
+  # The parsers below run for every file on every statistics call, so they
+  # walk the contents with :binary.match/2 and convert numbers with the
+  # binary_to_* BIFs. Lines, keys and values are sub-binaries of the file
+  # contents rather than copies.
   defp parse(:integer, content) do
-    case Integer.parse(String.trim(content)) do
-      {n, ""} -> {:ok, n}
+    case number(content, 0, line_length(content, 0)) do
+      n when is_integer(n) -> {:ok, n}
       _ -> :error
     end
   end
 
-  defp parse(:flat_keyed, content) do
-    map =
-      content
-      |> String.split("\n", trim: true)
-      |> Enum.reduce(%{}, &parse_flat_keyed_line/2)
+  defp parse(:flat_keyed, content),
+    do: content |> each_line(0, %{}, &flat_keyed_line/4) |> ok_map()
+
+  # Lines of a key and then key=value pairs, like io.stat
+  defp parse(:nested_keyed, content), do: parse(:pressure, content)
 
-    if map == %{}, do: :error, else: {:ok, map}
+  defp parse(:pressure, content),
+    do: content |> each_line(0, %{}, &pressure_line/4) |> ok_map()
+
+  defp ok_map(map) when map_size(map) == 0, do: :error
+  defp ok_map(map), do: {:ok, map}
+
+  defp each_line(content, start, acc, fun) when start < byte_size(content) do
+    len = line_length(content, start)
+    each_line(content, start + len + 1, fun.(content, start, len, acc), fun)
   end
 
-  defp parse(:pressure, content) do
-    map =
-      content
-      |> String.split("\n", trim: true)
-      |> Enum.reduce(%{}, &parse_pressure_line/2)
+  defp each_line(_content, _start, acc, _fun), do: acc
 
-    if map == %{}, do: :error, else: {:ok, map}
+  defp line_length(content, start) do
+    case :binary.match(content, "\n", scope: {start, byte_size(content) - start}) do
+      {pos, 1} -> pos - start
+      :nomatch -> byte_size(content) - start
+    end
   end
 
-  defp parse_flat_keyed_line(line, acc) do
-    with [key, value] <- String.split(line, " ", parts: 2),
-         {n, ""} <- Integer.parse(value) do
-      Map.put(acc, key, n)
+  # "key value"
+  defp flat_keyed_line(content, start, len, acc) do
+    with {pos, 1} <- :binary.match(content, " ", scope: {start, len}),
+         value when is_integer(value) <- number(content, pos + 1, start + len - pos - 1) do
+      Map.put(acc, binary_part(content, start, pos - start), value)
     else
       _ -> acc
     end
   end
 
-  defp parse_pressure_line(line, acc) do
-    case String.split(line, " ", trim: true) do
-      [kind | fields] ->
-        parsed = Enum.reduce(fields, %{}, &parse_pressure_field/2)
-        if parsed == %{}, do: acc, else: Map.put(acc, kind, parsed)
+  # "kind key=value key=value ..."
+  defp pressure_line(content, start, len, acc) do
+    case :binary.match(content, " ", scope: {start, len}) do
+      {pos, 1} ->
+        fields = pressure_fields(content, pos + 1, start + len, %{})
 
-      _ ->
+        if map_size(fields) == 0,
+          do: acc,
+          else: Map.put(acc, binary_part(content, start, pos - start), fields)
+
+      :nomatch ->
         acc
     end
   end
 
-  defp parse_pressure_field(field, inner) do
-    case String.split(field, "=", parts: 2) do
-      [k, v] ->
-        case parse_pressure_value(v) do
-          {:ok, value} -> Map.put(inner, k, value)
-          :error -> inner
-        end
+  defp pressure_fields(content, start, stop, acc) when start < stop do
+    field_len =
+      case :binary.match(content, " ", scope: {start, stop - start}) do
+        {pos, 1} -> pos - start
+        :nomatch -> stop - start
+      end
 
-      _ ->
-        inner
-    end
+    acc =
+      with {eq, 1} <- :binary.match(content, "=", scope: {start, field_len}),
+           value when is_number(value) <- number(content, eq + 1, start + field_len - eq - 1) do
+        Map.put(acc, binary_part(content, start, eq - start), value)
+      else
+        _ -> acc
+      end
+
+    pressure_fields(content, start + field_len + 1, stop, acc)
   end
 
-  defp parse_pressure_value(v) do
-    case Integer.parse(v) do
-      {n, ""} ->
-        {:ok, n}
+  defp pressure_fields(_content, _start, _stop, acc), do: acc
 
-      _ ->
-        case Float.parse(v) do
-          {f, ""} -> {:ok, f}
-          _ -> :error
-        end
+  defp number(_content, _start, 0), do: nil
+
+  defp number(content, start, len) do
+    value = binary_part(content, start, len)
+
+    case :binary.match(value, ".") do
+      :nomatch -> :erlang.binary_to_integer(value)
+      _ -> :erlang.binary_to_float(value)
     end
+  rescue
+    ArgumentError -> nil
   end
 end
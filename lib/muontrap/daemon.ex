@@ -27,7 +27,9 @@ defmodule MuonTrap.Daemon do
   In the `child_spec` tuple, the second element is a list that corresponds to
   the `MuonTrap.cmd/3` parameters. I.e., The first item in the list is the
   program to run, the second is a list of commandline arguments, and the third
-  is a list of options. The same options as `MuonTrap.cmd/3` are available with
+  is a list of options. It can also be a `MuonTrap.Spec` made for `:daemon` so
+  that the options are only validated once no matter how many times the
+  daemon is restarted. The same options as `MuonTrap.cmd/3` are available with
   the following additions:
 
   * `:name` - Register the specified name for the daemon GenServer
@@ -37,6 +39,18 @@ defmodule MuonTrap.Daemon do
     and `:logger_metadata` will be ignored.
   * `:log_output` - When set, send output from the command to the Logger.
     Specify the log level (e.g., `:debug`)
+  * `:stderr_log_output` - When set, capture stderr separately and log it at
+    this level (e.g., `:error`). `:log_prefix`, `:log_transform` and
+    `:logger_metadata` apply to it too. If `:logger_fun` is set, stderr lines
+    are passed to it as well.
+  * `:max_line_length` - When set, muontrap splits output into lines before
+    sending it to the daemon. Lines longer than this many bytes are cut
+    short and logged with a `"..."` suffix. Without it, the daemon splits
+    lines itself and partial lines longer than 256 bytes are truncated.
+    Must be less than `:stdio_window`.
+  * `:max_partial_line_length` - Without `:max_line_length`, the daemon
+    buffers up to this many bytes of a line while it waits for the rest of
+    it. Anything past that is dropped. Defaults to 256.
   * `:log_prefix` - Prefix each log message with this string (defaults to the
     program's path)
   * `:log_transform` - Pass a function that takes a string and returns a string
@@ -45,6 +59,11 @@ defmodule MuonTrap.Daemon do
   * `:logger_metadata` - A keyword list to merge into the process's logger metadata.
     The `:muontrap_cmd` and `:muontrap_args` keys are automatically added and
     cannot be overridden.
+  * `:async_logging` - When `true`, output is logged by a separate process
+    linked to the daemon so that a slow logger doesn't hold up calls to the
+    daemon. Output is acknowledged to muontrap once it's been logged, so the
+    `:stdio_window` still limits how much can be waiting and a command that
+    outputs faster than it can be logged is slowed down. Defaults to `false`.
   * `:stderr_to_stdout` - When set to `true`, redirect stderr to stdout.
     Defaults to `false`.
   * `:capture_stderr_only` - When set to `true`, capture only stderr and ignore stdout.
@@ -52,7 +71,53 @@ defmodule MuonTrap.Daemon do
     Defaults to `false`.
   * `:exit_status_to_reason` - Optional function to convert the exit status (a
     number) to stop reason for the Daemon GenServer. Use if error exit codes
-    carry information or aren't errors.
+    carry information or aren't errors. A 2-arity function is also passed the
+    output tail when `:tail_bytes` is set (`""` if there wasn't one).
+  * `:output_file` - Write the command's output to this file in muontrap
+    rather than sending it to the daemon. Stderr is included with
+    `:stderr_to_stdout`. Stderr captured with `:stderr_log_output` is still
+    logged. Can't be used with `:log_output`.
+  * `:output_file_max_bytes` - Rotate the `:output_file` when it reaches this
+    size. The old file is renamed with a `.1` suffix, the one before that
+    gets `.2` and so on.
+  * `:output_file_keep` - How many rotated files to keep. Defaults to 1.
+  * `:stats_interval` - Have muontrap sample the cgroup's stats every this
+    many milliseconds and send them to the daemon. `sampled_statistics/1`
+    returns the latest sample without reading any files. Requires a cgroup.
+  * `:stats_collector` - Register the daemon's cgroup with this
+    `MuonTrap.StatsCollector` so that its statistics can be read from the
+    collector without calling the daemon. Ignored if there's no cgroup.
+  * `:pressure_triggers` - A list of `{resource, kind, stall_us, window_us}`
+    PSI triggers for the cgroup. `resource` is `:memory`, `:cpu` or `:io`
+    and `kind` is `:some` or `:full`. A trigger fires when tasks stall on the
+    resource for `stall_us` microseconds within a `window_us` microsecond
+    window. The kernel fires a trigger at most once per window. Windows must
+    be between 0.5 and 10 seconds and, unless the BEAM has
+    `CAP_SYS_RESOURCE`, a multiple of 2 seconds. Each time one fires, the
+    `:event_handler` gets `{:pressure, resource, kind, pressure}` where
+    `pressure` is the parsed pressure file. Requires a cgroup and an
+    `:event_handler`.
+  * `:cgroup_events` - When `true`, watch the cgroup's `memory.events` and
+    `pids.events` files. The `:event_handler` gets `{:memory_events, counts}`
+    or `{:pids_events, counts}` as soon as a counter changes, e.g.,
+    `{:memory_events, %{"oom_kill" => 1}}` when a process is OOM-killed.
+    `counts` only has the counters that changed. Files for controllers that
+    aren't enabled aren't watched. Requires a cgroup and an `:event_handler`.
+  * `:event_handler` - A pid or registered name to send events to as
+    `{:muontrap_event, daemon_pid, event}` messages, or a 1-arity function
+    to call with each event from the daemon process.
+  * `:resource_usage` - When `true`, log the command's CPU time and max RSS
+    when it exits. The full resource usage (see `MuonTrap.cmd/3`) is in the
+    `:muontrap_resource_usage` logger metadata of that message.
+  * `:tail_bytes` - Keep this many bytes of the most recent output in
+    muontrap and get them back when the command exits. This works whether
+    or not output is logged. Output that isn't logged stays in muontrap.
+    Stderr is included if it's captured or with `stderr_to_stdout: true`.
+    When the command fails, the stop reason is `{:error_exit_status, tail}`
+    unless `:exit_status_to_reason` says otherwise.
+  * `:forward_stdin` - When `true`, give the command a stdin that `write/2`
+    sends data to. Close it with `close_stdin/1`. Without this, the command
+    inherits muontrap's stdin.
   * `:wait_for` - A 0-arity function that runs before the OS process is
     launched. Use to wait for a required resource to be available. The return
     value is ignored. Raise to abort the launch.
@@ -72,19 +137,36 @@ defmodule MuonTrap.Daemon do
 
   defstruct [
     :buffer,
+    :stderr_buffer,
+    :max_partial_line_length,
     :command,
     :port,
     :port_options,
     :cgroup_path,
+    :cgroup_pool,
     :logger_fun,
+    :stderr_logger_fun,
+    :log_consumer,
     :exit_status_to_reason,
     :output_byte_count,
+    :ack_batch,
+    :unacked,
+    :protocol,
+    :stdio_window,
+    :stdin_credit,
+    :stdin_queue,
+    :stdin_state,
+    :tail,
+    :resource_usage,
+    :cgroup_sample,
+    :pressure_triggers,
+    :event_handler,
     :wait_task
   ]
 
   @max_data_to_buffer 256
 
-  @spec child_spec(keyword()) :: Supervisor.child_spec()
+  @spec child_spec(keyword() | MuonTrap.Spec.t()) :: Supervisor.child_spec()
   def child_spec([command, args]) do
     child_spec([command, args, []])
   end
@@ -99,6 +181,16 @@ defmodule MuonTrap.Daemon do
     }
   end
 
+  def child_spec(spec) do
+    %{
+      id: __MODULE__,
+      start: {__MODULE__, :start_link, [spec]},
+      type: :worker,
+      restart: :permanent,
+      shutdown: 500
+    }
+  end
+
   @doc """
   Start/link a deamon GenServer for the specified command.
   """
@@ -113,6 +205,27 @@ defmodule MuonTrap.Daemon do
     GenServer.start_link(__MODULE__, [command, args, opts], genserver_opts)
   end
 
+  @doc """
+  Start/link a daemon GenServer from a `MuonTrap.Spec`
+
+  The spec has to be made for `:daemon`. Its `:name` option names the
+  GenServer.
+  """
+  @spec start_link(MuonTrap.Spec.t()) :: GenServer.on_start()
+  def start_link(spec) do
+    if MuonTrap.Spec.context(spec) != :daemon do
+      raise ArgumentError, "MuonTrap.Daemon.start_link/1 needs a spec made for :daemon"
+    end
+
+    genserver_opts =
+      case MuonTrap.Spec.name(spec) do
+        nil -> []
+        name -> [name: name]
+      end
+
+    GenServer.start_link(__MODULE__, spec, genserver_opts)
+  end
+
   @doc """
   Read a cgroup v2 interface file from the daemon's cgroup
 
@@ -133,7 +246,8 @@ defmodule MuonTrap.Daemon do
   Write a value to a cgroup v2 interface file in the daemon's cgroup
 
   Returns `{:error, :no_cgroup}` if the daemon wasn't started under a
-  cgroup.
+  cgroup. A cgroup from a `MuonTrap.CgroupPool` that's written to isn't
+  reused after the daemon exits.
   """
   @spec cgset(GenServer.server(), binary(), binary()) ::
           :ok | {:error, File.posix() | :no_cgroup}
@@ -189,6 +303,28 @@ defmodule MuonTrap.Daemon do
     GenServer.call(server, :cgroup_path)
   end
 
+  @doc """
+  Write data to the command's stdin
+
+  The daemon must have been started with `forward_stdin: true`. This returns
+  once muontrap has room for all of the data, so writers slow down to the
+  rate that the command reads its input.
+  """
+  @spec write(GenServer.server(), iodata()) :: :ok | {:error, :closed | :not_forwarding}
+  def write(server, data) do
+    GenServer.call(server, {:write, IO.iodata_to_binary(data)}, :infinity)
+  end
+
+  @doc """
+  Close the command's stdin
+
+  Data already passed to `write/2` is written first.
+  """
+  @spec close_stdin(GenServer.server()) :: :ok | {:error, :not_forwarding}
+  def close_stdin(server) do
+    GenServer.call(server, :close_stdin)
+  end
+
   @doc """
   Return the OS pid to the muontrap executable
   """
@@ -203,6 +339,8 @@ defmodule MuonTrap.Daemon do
   Always-present keys:
 
   * `:output_byte_count` - bytes output by the process being run
+  * `:stdio_window` - current maximum bytes of output in flight. This
+    changes over time when `:stdio_window` is a range.
   * `:cgroup` - map of cgroup v2 statistics (empty if the daemon isn't
     running under a cgroup)
 
@@ -230,19 +368,56 @@ defmodule MuonTrap.Daemon do
 
   See the kernel's `Documentation/admin-guide/cgroup-v2.rst` for the full
   semantics of each file.
+
+  With `:stats_collector`, `MuonTrap.StatsCollector.statistics/2` returns
+  the `:cgroup` map from the collector's last sweep without calling the
+  daemon.
   """
   @spec statistics(GenServer.server()) :: %{
           output_byte_count: non_neg_integer(),
+          stdio_window: pos_integer(),
           cgroup: %{optional(String.t()) => term()}
         }
   def statistics(server) do
     GenServer.call(server, :statistics)
   end
 
+  @doc """
+  Return the latest cgroup stats that muontrap sampled
+
+  This needs the `:stats_interval` option. It doesn't read any files, so
+  it's cheaper than `statistics/1`. The map is empty until the first sample
+  arrives, and it's always empty without `:stats_interval`. It's keyed by
+  atoms:
+
+  * `:memory_current` - bytes
+  * `:pids_current` - count
+  * `:cpu_usage_usec` - total CPU time
+  * `:cpu_percent` - CPU use since the previous sample (100.0 is one CPU)
+  * `:io_read_bytes`, `:io_write_bytes` - totals across devices
+  * `:io_read_bytes_per_sec`, `:io_write_bytes_per_sec` - rates since the
+    previous sample
+  * `:memory_pressure_avg10`, `:cpu_pressure_avg10`, `:io_pressure_avg10` -
+    the PSI `some avg10` percentages
+  """
+  @spec sampled_statistics(GenServer.server()) :: %{optional(atom()) => number()}
+  def sampled_statistics(server) do
+    GenServer.call(server, :sampled_statistics)
+  end
+
   @impl GenServer
   def init([command, args, opts]) do
-    options = MuonTrap.Options.validate(:daemon, command, args, opts)
-    port_options = MuonTrap.Port.port_options(options) ++ [:stream]
+    init(MuonTrap.Spec.new(:daemon, command, args, opts))
+  end
+
+  def init(spec) do
+    # A cgroup from a pool goes back when the pool sees this process exit
+    {options, port_options} = MuonTrap.Spec.launch(spec)
+    {command, args} = MuonTrap.Spec.command(spec)
+
+    with %{stats_collector: collector, cgroup_path: cgroup_path} <- options do
+      MuonTrap.StatsCollector.register(collector, cgroup_path)
+    end
 
     # Logger.metadata/0 has a side effect to set the metadata for the current process
     options
@@ -252,14 +427,31 @@ defmodule MuonTrap.Daemon do
 
     state = %__MODULE__{
       buffer: "",
+      stderr_buffer: "",
+      max_partial_line_length: Map.get(options, :max_partial_line_length, @max_data_to_buffer),
       command: command,
       port: nil,
       port_options: port_options,
       cgroup_path: Map.get(options, :cgroup_path),
+      cgroup_pool: Map.get(options, :cgroup_pool),
       logger_fun: logger_fun(options, command),
+      stderr_logger_fun: stderr_logger_fun(options, command),
+      log_consumer: if(Map.get(options, :async_logging), do: start_log_consumer()),
       exit_status_to_reason:
-        Map.get(options, :exit_status_to_reason, fn _ -> :error_exit_status end),
+        Map.get(options, :exit_status_to_reason, default_exit_status_to_reason(options)),
       output_byte_count: 0,
+      ack_batch: Map.get(options, :batch_bytes),
+      unacked: 0,
+      protocol: Map.get(options, :protocol, 1),
+      stdio_window: MuonTrap.Port.initial_stdio_window(options),
+      stdin_credit: MuonTrap.Port.stdin_window(),
+      stdin_queue: :queue.new(),
+      stdin_state: if(Map.get(options, :forward_stdin), do: :open, else: :not_forwarding),
+      tail: "",
+      resource_usage: nil,
+      cgroup_sample: if(Map.has_key?(options, :stats_interval), do: %{}),
+      pressure_triggers: Map.get(options, :pressure_triggers, []),
+      event_handler: Map.get(options, :event_handler),
       wait_task: nil
     }
 
@@ -271,6 +463,11 @@ defmodule MuonTrap.Daemon do
     end
   end
 
+  defp default_exit_status_to_reason(%{tail_bytes: _}),
+    do: fn _status, tail -> {:error_exit_status, tail} end
+
+  defp default_exit_status_to_reason(_options), do: fn _status -> :error_exit_status end
+
   defp start_port(state) do
     port =
       Port.open({:spawn_executable, to_charlist(MuonTrap.muontrap_path())}, state.port_options)
@@ -282,17 +479,23 @@ defmodule MuonTrap.Daemon do
   defp logger_fun(%{logger_fun: {m, f, a}}, _command), do: &apply(m, f, [&1 | a])
 
   defp logger_fun(options, command) do
-    log_output = Map.get(options, :log_output)
+    log_fun(Map.get(options, :log_output), options, command)
+  end
 
-    if log_output == nil do
-      fn _line -> :ok end
-    else
-      log_prefix = Map.get(options, :log_prefix, command <> ": ")
-      log_transform = Map.get(options, :log_transform, &default_transform/1)
+  defp stderr_logger_fun(%{logger_fun: _} = options, command), do: logger_fun(options, command)
 
-      fn line ->
-        Logger.log(log_output, [log_prefix, log_transform.(line)])
-      end
+  defp stderr_logger_fun(options, command) do
+    log_fun(Map.get(options, :stderr_log_output), options, command)
+  end
+
+  defp log_fun(nil, _options, _command), do: fn _line -> :ok end
+
+  defp log_fun(level, options, command) do
+    log_prefix = Map.get(options, :log_prefix, command <> ": ")
+    log_transform = Map.get(options, :log_transform, &default_transform/1)
+
+    fn line ->
+      Logger.log(level, [log_prefix, log_transform.(line)])
     end
   end
 
@@ -324,6 +527,11 @@ defmodule MuonTrap.Daemon do
       ) do
     result = Cgroups.cgset(cgroup_path, variable_name, value)
 
+    # The pool can't undo this for the next command to use the cgroup
+    if result == :ok and state.cgroup_pool do
+      MuonTrap.CgroupPool.retire(state.cgroup_pool, cgroup_path)
+    end
+
     {:reply, result, state}
   end
 
@@ -349,40 +557,84 @@ defmodule MuonTrap.Daemon do
     {:reply, os_pid, state}
   end
 
+  def handle_call({:write, _data}, _from, %{stdin_state: :not_forwarding} = state) do
+    {:reply, {:error, :not_forwarding}, state}
+  end
+
+  def handle_call({:write, data}, from, %{stdin_state: :open} = state) do
+    queue = :queue.in({from, data}, state.stdin_queue)
+    {:noreply, flush_stdin(%{state | stdin_queue: queue})}
+  end
+
+  def handle_call({:write, _data}, _from, state) do
+    {:reply, {:error, :closed}, state}
+  end
+
+  def handle_call(:close_stdin, _from, %{stdin_state: :not_forwarding} = state) do
+    {:reply, {:error, :not_forwarding}, state}
+  end
+
+  def handle_call(:close_stdin, _from, %{stdin_state: :open} = state) do
+    {:reply, :ok, flush_stdin(%{state | stdin_state: :closing})}
+  end
+
+  def handle_call(:close_stdin, _from, state) do
+    {:reply, :ok, state}
+  end
+
   def handle_call(:statistics, _from, state) do
     statistics = %{
       output_byte_count: state.output_byte_count,
+      stdio_window: state.stdio_window,
       cgroup: Cgroups.statistics(state.cgroup_path)
     }
 
     {:reply, statistics, state}
   end
 
+  def handle_call(:sampled_statistics, _from, state) do
+    {:reply, state.cgroup_sample || %{}, state}
+  end
+
   @impl GenServer
   def handle_info({ref, _result}, %__MODULE__{wait_task: %Task{ref: ref}} = state) do
     Process.demonitor(ref, [:flush])
-    {:noreply, start_port(%{state | wait_task: nil})}
+    state = start_port(%{state | wait_task: nil})
+    {:noreply, flush_stdin(state)}
   end
 
   def handle_info({port, {:data, message}}, %__MODULE__{port: port} = state) do
-    bytes_received = byte_size(message)
-    state = split_and_log(message, state)
+    {:noreply, handle_port_message(MuonTrap.Port.decode(state.protocol, message), state)}
+  end
 
-    MuonTrap.Port.report_bytes_handled(state.port, bytes_received)
+  def handle_info({:logged, consumer, count}, %__MODULE__{log_consumer: consumer} = state) do
+    {:noreply, acknowledge(state, count)}
+  end
 
-    {:noreply, %{state | output_byte_count: state.output_byte_count + bytes_received}}
+  def handle_info(:send_acks, state) do
+    {:noreply, send_acks(state)}
   end
 
   def handle_info({port, {:exit_status, status}}, %__MODULE__{port: port} = state) do
+    flush_log_consumer(state)
+
     reason =
       case status do
         0 ->
-          Logger.info("#{state.command}: Process exited successfully")
+          Logger.info(
+            "#{state.command}: Process exited successfully#{usage_summary(state)}",
+            usage_metadata(state)
+          )
+
           :normal
 
         _failure ->
-          Logger.error("#{state.command}: Process exited with status #{status}")
-          state.exit_status_to_reason.(status)
+          Logger.error(
+            "#{state.command}: Process exited with status #{status}#{usage_summary(state)}",
+            usage_metadata(state)
+          )
+
+          exit_status_to_reason(state, status)
       end
 
     {:stop, reason, state}
@@ -413,30 +665,244 @@ defmodule MuonTrap.Daemon do
     {:noreply, state}
   end
 
-  defp split_and_log(data, state) do
-    {lines, remainder} = process_data(state.buffer <> data)
+  defp handle_port_message({:output, data}, state) do
+    {lines, remainder} = process_data(state.buffer, data, state.max_partial_line_length)
+    log_lines(%{state | buffer: remainder}, state.logger_fun, lines, byte_size(data))
+  end
+
+  defp handle_port_message({:stderr, data}, state) do
+    {lines, remainder} = process_data(state.stderr_buffer, data, state.max_partial_line_length)
+    state = %{state | stderr_buffer: remainder}
+    log_lines(state, state.stderr_logger_fun, lines, byte_size(data))
+  end
 
-    Enum.each(lines, &state.logger_fun.(&1))
+  defp handle_port_message({:line, stream, line, truncated}, state) do
+    logger_fun = if stream == :stderr, do: state.stderr_logger_fun, else: state.logger_fun
+    message = if truncated, do: line <> "...", else: line
 
-    %{state | buffer: remainder}
+    # Lines are charged one more byte than their length for the newline
+    log_lines(state, logger_fun, [message], byte_size(line) + 1)
   end
 
-  @doc false
-  @spec process_data(binary()) :: {[String.t()], binary()}
-  def process_data(data) do
-    data |> String.split("\n") |> process_lines([])
+  defp handle_port_message({:stdin_credit, count}, state) do
+    flush_stdin(%{state | stdin_credit: state.stdin_credit + count})
+  end
+
+  defp handle_port_message({:window, size}, state) do
+    %{state | stdio_window: size}
+  end
+
+  # The tail and resource usage come just before the exit status and aren't
+  # acknowledged
+  defp handle_port_message({:tail, tail}, state) do
+    %{state | tail: tail}
+  end
+
+  defp handle_port_message({:resource_usage, usage}, state) do
+    %{state | resource_usage: usage}
+  end
+
+  # Samples only have the stats that changed
+  defp handle_port_message({:stats, _elapsed_ms, stats}, state) do
+    %{state | cgroup_sample: Map.merge(state.cgroup_sample, stats)}
+  end
+
+  # muontrap identifies triggers by their index in :pressure_triggers
+  defp handle_port_message({:pressure, index, pressure}, state) do
+    {resource, kind, _stall_us, _window_us} = Enum.at(state.pressure_triggers, index)
+    notify(state, {:pressure, resource, kind, pressure})
+    state
+  end
+
+  # Counters only include the ones that changed
+  defp handle_port_message({:cgroup_events, kind, counts}, state) do
+    notify(state, {kind, counts})
+    state
+  end
+
+  defp notify(%{event_handler: fun}, event) when is_function(fun, 1), do: fun.(event)
+
+  defp notify(%{event_handler: name} = state, event) when is_atom(name) do
+    # Drop events while a named handler isn't running rather than crashing
+    case Process.whereis(name) do
+      nil -> :ok
+      pid -> notify(%{state | event_handler: pid}, event)
+    end
+  end
+
+  defp notify(%{event_handler: pid}, event), do: send(pid, {:muontrap_event, self(), event})
+
+  defp usage_summary(%{resource_usage: %{"rusage" => rusage}}) do
+    cpu_ms = div(Map.get(rusage, "utime_usec", 0) + Map.get(rusage, "stime_usec", 0), 1000)
+    " (cpu #{cpu_ms} ms, max rss #{Map.get(rusage, "maxrss_kb", 0)} KB)"
+  end
+
+  defp usage_summary(_state), do: ""
+
+  defp usage_metadata(%{resource_usage: nil}), do: []
+  defp usage_metadata(state), do: [muontrap_resource_usage: state.resource_usage]
+
+  defp exit_status_to_reason(%{exit_status_to_reason: fun} = state, status)
+       when is_function(fun, 2),
+       do: fun.(status, state.tail)
+
+  defp exit_status_to_reason(state, status), do: state.exit_status_to_reason.(status)
+
+  # Send queued writes as credit allows and reply to writers once all of their
+  # data is on its way. Stdin is closed after the last write when requested.
+  defp flush_stdin(%{port: nil} = state), do: state
+
+  defp flush_stdin(state) do
+    case :queue.out(state.stdin_queue) do
+      {{:value, {from, data}}, queue} ->
+        case MuonTrap.Port.send_stdin(state.port, data, state.stdin_credit) do
+          {"", credit} ->
+            GenServer.reply(from, :ok)
+            flush_stdin(%{state | stdin_queue: queue, stdin_credit: credit})
+
+          {rest, credit} ->
+            %{state | stdin_queue: :queue.in_r({from, rest}, queue), stdin_credit: credit}
+        end
+
+      {:empty, _queue} when state.stdin_state == :closing ->
+        MuonTrap.Port.close_stdin(state.port)
+        %{state | stdin_state: :closed}
+
+      {:empty, _queue} ->
+        state
+    end
+  end
+
+  defp log_lines(%{log_consumer: nil} = state, logger_fun, lines, bytes_received) do
+    Enum.each(lines, logger_fun)
+    output_handled(bytes_received, state)
+  end
+
+  defp log_lines(state, logger_fun, lines, bytes_received) do
+    send(state.log_consumer, {:log, logger_fun, lines, bytes_received})
+    %{state | output_byte_count: state.output_byte_count + bytes_received}
+  end
+
+  # The consumer logs batches of lines in the order that they arrived and
+  # tells the daemon how many bytes of output it's done with so that they
+  # can be acknowledged. It gets the daemon's logger metadata. The link
+  # doesn't stop it when the daemon exits normally, so it also monitors the
+  # daemon.
+  defp start_log_consumer() do
+    daemon = self()
+    metadata = Logger.metadata()
+
+    spawn_link(fn ->
+      Logger.metadata(metadata)
+      log_consumer_loop(daemon, Process.monitor(daemon))
+    end)
+  end
+
+  defp log_consumer_loop(daemon, daemon_ref) do
+    receive do
+      {:log, logger_fun, lines, bytes_received} ->
+        Enum.each(lines, logger_fun)
+        send(daemon, {:logged, self(), bytes_received})
+        log_consumer_loop(daemon, daemon_ref)
+
+      {:flush, ref} ->
+        send(daemon, {ref, :flushed})
+        log_consumer_loop(daemon, daemon_ref)
+
+      {:DOWN, ^daemon_ref, :process, _pid, _reason} ->
+        :ok
+    end
+  end
+
+  # Log everything that's queued before the exit message
+  defp flush_log_consumer(%{log_consumer: nil}), do: :ok
+
+  defp flush_log_consumer(state) do
+    ref = make_ref()
+    send(state.log_consumer, {:flush, ref})
+
+    receive do
+      {^ref, :flushed} -> :ok
+    after
+      5000 -> :ok
+    end
+  end
+
+  defp output_handled(bytes_received, state) do
+    state = acknowledge(state, bytes_received)
+    %{state | output_byte_count: state.output_byte_count + bytes_received}
+  end
+
+  # With :batch_bytes, acknowledgments are held until there's that much
+  # output to acknowledge or the messages already in the mailbox have been
+  # handled. The :send_acks message is queued behind them.
+  defp acknowledge(%{ack_batch: nil} = state, count) do
+    MuonTrap.Port.report_bytes_handled(state.port, count, state.protocol)
+    state
   end
 
-  defp process_lines([leftovers], acc) do
-    {Enum.reverse(acc), trim_buffer(leftovers)}
+  defp acknowledge(state, count) do
+    unacked = state.unacked + count
+
+    cond do
+      unacked >= state.ack_batch ->
+        send_acks(%{state | unacked: unacked})
+
+      state.unacked == 0 ->
+        send(self(), :send_acks)
+        %{state | unacked: unacked}
+
+      true ->
+        %{state | unacked: unacked}
+    end
   end
 
-  defp process_lines([line | rest], acc) do
-    process_lines(rest, [line | acc])
+  defp send_acks(%{unacked: 0} = state), do: state
+
+  defp send_acks(state) do
+    MuonTrap.Port.report_bytes_handled(state.port, state.unacked, state.protocol)
+    %{state | unacked: 0}
   end
 
-  defp trim_buffer(data) when byte_size(data) > @max_data_to_buffer,
-    do: :binary.part(data, 0, @max_data_to_buffer)
+  @doc false
+  @spec process_data(binary()) :: {[String.t()], iodata()}
+  def process_data(data), do: process_data("", data, @max_data_to_buffer)
 
-  defp trim_buffer(data), do: data
+  # Split newly received data into lines. Only the first line, which
+  # finishes the partial line from before, is copied. The others are
+  # sub-binaries of `data`. The partial line is kept as iodata so that
+  # chunks of a long line aren't concatenated each time one arrives.
+  @doc false
+  @spec process_data(iodata(), binary(), pos_integer()) :: {[String.t()], iodata()}
+  def process_data(partial, data, max_length) do
+    case :binary.matches(data, "\n") do
+      [] ->
+        {[], append_partial(partial, data, 0, max_length)}
+
+      [{first, 1} | rest] ->
+        line = complete_line(partial, binary_part(data, 0, first))
+        {lines, start} = split_lines(data, rest, first + 1, [line])
+        {lines, append_partial("", data, start, max_length)}
+    end
+  end
+
+  defp complete_line("", part), do: part
+  defp complete_line(partial, part), do: IO.iodata_to_binary([partial, part])
+
+  defp split_lines(data, [{pos, 1} | rest], start, acc),
+    do: split_lines(data, rest, pos + 1, [binary_part(data, start, pos - start) | acc])
+
+  defp split_lines(_data, [], start, acc), do: {Enum.reverse(acc), start}
+
+  defp append_partial(partial, data, start, max_length) do
+    room = max_length - IO.iodata_length(partial)
+    len = min(byte_size(data) - start, room)
+
+    cond do
+      len <= 0 -> partial
+      # Copy so that the partial line doesn't keep all of `data` around
+      partial == "" -> :binary.copy(binary_part(data, start, len))
+      true -> [partial, :binary.copy(binary_part(data, start, len))]
+    end
+  end
 end
@@ -27,6 +27,11 @@ defmodule MuonTrap.Options do
   * `:arg0`
   * `:stderr_to_stdout`
   * `:capture_stderr_only`
+  * `:stderr_into` - `MuonTrap.cmd/3` only
+  * `:input` - `MuonTrap.cmd/3` only
+  * `:resource_usage`
+  * `:forward_stdin` - `MuonTrap.Daemon`-only
+  * `:stderr_log_output` - `MuonTrap.Daemon`-only
   * `:parallelism`
   * `:env`
   * `:name` - `MuonTrap.Daemon`-only
@@ -34,13 +39,31 @@ defmodule MuonTrap.Options do
   * `:log_output` - `MuonTrap.Daemon`-only, ignored if logger_fun is set
   * `:log_prefix` - `MuonTrap.Daemon`-only, ignored if logger_fun is set
   * `:log_transform` - `MuonTrap.Daemon`-only, ignored if logger_fun is set
+  * `:max_line_length` - `MuonTrap.Daemon`-only
+  * `:max_partial_line_length` - `MuonTrap.Daemon`-only
+  * `:async_logging` - `MuonTrap.Daemon`-only
+  * `:tail_bytes` - `MuonTrap.Daemon`-only
+  * `:stats_interval` - `MuonTrap.Daemon`-only
+  * `:stats_collector` - `MuonTrap.Daemon`-only
+  * `:pressure_triggers` - `MuonTrap.Daemon`-only
+  * `:cgroup_events` - `MuonTrap.Daemon`-only
+  * `:event_handler` - `MuonTrap.Daemon`-only
+  * `:output_file` - `MuonTrap.Daemon`-only
+  * `:output_file_max_bytes` - `MuonTrap.Daemon`-only
+  * `:output_file_keep` - `MuonTrap.Daemon`-only
   * `:logger_metadata` - `MuonTrap.Daemon`-only, ignored if logger_fun is set and doesn't call the Elixir Logger
   * `:stdio_window`
+  * `:pipe_size`
+  * `:high_throughput`
+  * `:batch_bytes`
+  * `:batch_usecs`
+  * `:protocol`
   * `:exit_status_to_reason` - `MuonTrap.Daemon`-only
   * `:wait_for` - `MuonTrap.Daemon`-only
   * `:cgroup`
   * `:cgroup_path`
   * `:cgroup_base`
+  * `:cgroup_pool`
   * `:delay_to_sigkill`
   * `:uid`
   * `:gid`
@@ -71,17 +94,135 @@ defmodule MuonTrap.Options do
     abs_command = System.find_executable(cmd) || :erlang.error(:enoent, [cmd, args, opts])
 
     validate_options(context, abs_command, args, opts)
+    |> validate_output_file()
+    |> validate_separate_stderr()
+    |> resolve_high_throughput()
+    |> validate_max_line_length()
+    |> validate_event_handler()
+    |> validate_batch()
+    |> resolve_protocol()
     |> resolve_cgroup_path()
     |> validate_cgroup_has_path()
   end
 
+  # Measured with `head -c 500000000 /dev/zero`, these settings moved output
+  # about 2.8x faster than the defaults
+  @high_throughput_pipe_size 1_048_576
+  @high_throughput_stdio_window 4_194_304
+
+  defp resolve_high_throughput(%{high_throughput: true} = options) do
+    options
+    |> Map.put_new(:pipe_size, @high_throughput_pipe_size)
+    |> Map.put_new(:stdio_window, @high_throughput_stdio_window)
+  end
+
+  defp resolve_high_throughput(options), do: options
+
+  # Lines are acknowledged whole, so the longest line has to fit in the window
+  defp validate_max_line_length(%{max_line_length: length} = options) do
+    smallest_window =
+      case options do
+        %{stdio_window: %Range{first: first}} -> first
+        _ -> MuonTrap.Port.initial_stdio_window(options)
+      end
+
+    if length >= smallest_window do
+      raise ArgumentError,
+            ":max_line_length (#{length}) must be less than the :stdio_window (#{smallest_window})"
+    end
+
+    options
+  end
+
+  defp validate_max_line_length(options), do: options
+
+  defp validate_batch(%{batch_usecs: _} = options) when not is_map_key(options, :batch_bytes) do
+    raise ArgumentError, ":batch_usecs requires :batch_bytes"
+  end
+
+  defp validate_batch(options), do: options
+
+  defp validate_event_handler(%{event_handler: _} = options), do: options
+
+  defp validate_event_handler(options) do
+    case Enum.find([:pressure_triggers, :cgroup_events], &Map.get(options, &1)) do
+      nil -> options
+      option -> raise ArgumentError, "#{inspect(option)} requires an :event_handler"
+    end
+  end
+
+  # Output that goes to the file doesn't come back to be logged
+  defp validate_output_file(%{output_file: _, log_output: _}) do
+    raise ArgumentError, "cannot specify both :output_file and :log_output"
+  end
+
+  defp validate_output_file(%{output_file: _} = options), do: options
+
+  defp validate_output_file(options) do
+    case Enum.find([:output_file_max_bytes, :output_file_keep], &Map.has_key?(options, &1)) do
+      nil -> options
+      option -> raise ArgumentError, "#{inspect(option)} requires :output_file"
+    end
+  end
+
+  defp validate_separate_stderr(options) do
+    separate = Enum.find([:stderr_into, :stderr_log_output], &Map.has_key?(options, &1))
+    merged = Enum.find([:stderr_to_stdout, :capture_stderr_only], &Map.get(options, &1))
+
+    if separate && merged do
+      raise ArgumentError, "cannot specify both #{inspect(separate)} and #{inspect(merged)}"
+    end
+
+    options
+  end
+
+  # Some options report back to Elixir in packets that only protocol 2 has, so
+  # they turn it on unless protocol 1 was explicitly requested.
+  defp resolve_protocol(options) do
+    case {protocol_2_option(options), Map.get(options, :protocol)} do
+      {nil, _protocol} ->
+        options
+
+      {option, 1} ->
+        raise ArgumentError, "#{inspect(option)} requires protocol 2"
+
+      {_option, _protocol} ->
+        Map.put(options, :protocol, 2)
+    end
+  end
+
+  defp protocol_2_option(%{stdio_window: %Range{}}), do: :stdio_window
+  defp protocol_2_option(%{stderr_into: _}), do: :stderr_into
+  defp protocol_2_option(%{stderr_log_output: _}), do: :stderr_log_output
+  defp protocol_2_option(%{max_line_length: _}), do: :max_line_length
+  defp protocol_2_option(%{input: _}), do: :input
+  defp protocol_2_option(%{forward_stdin: true}), do: :forward_stdin
+  defp protocol_2_option(%{tail_bytes: _}), do: :tail_bytes
+  defp protocol_2_option(%{resource_usage: true}), do: :resource_usage
+  defp protocol_2_option(%{stats_interval: _}), do: :stats_interval
+  defp protocol_2_option(%{pressure_triggers: _}), do: :pressure_triggers
+  defp protocol_2_option(%{cgroup_events: true}), do: :cgroup_events
+  defp protocol_2_option(%{high_throughput: true}), do: :high_throughput
+  defp protocol_2_option(_options), do: nil
+
+  defp resolve_cgroup_path(%{cgroup_pool: _pool} = options) do
+    # The pool's cgroups come with their own path and settings
+    conflict =
+      Enum.find([:cgroup_path, :cgroup_base, :cgroup_controllers], &Map.has_key?(options, &1))
+
+    case conflict do
+      nil -> options
+      :cgroup_controllers -> raise ArgumentError, "cannot specify both a cgroup_pool and a cgroup"
+      key -> raise ArgumentError, "cannot specify both a cgroup_pool and a #{key}"
+    end
+  end
+
   defp resolve_cgroup_path(%{cgroup_path: _path, cgroup_base: _base}) do
     raise ArgumentError, "cannot specify both a cgroup_path and a cgroup_base"
   end
 
   defp resolve_cgroup_path(%{cgroup_base: base} = options) do
-    # Create a random subfolder for this invocation
-    Map.put(options, :cgroup_path, Path.join(base, random_string()))
+    Map.put(options, :cgroup_path, cgroup_base_path(base))
   end
 
   defp resolve_cgroup_path(other), do: other
@@ -90,13 +231,43 @@ defmodule MuonTrap.Options do
   # cgroup path to apply it to, so reject it up front rather than running the
   # command with none of the requested limits.
   defp validate_cgroup_has_path(%{cgroup_path: _path} = options), do: options
+  defp validate_cgroup_has_path(%{cgroup_pool: _pool} = options), do: options
 
   defp validate_cgroup_has_path(%{cgroup_controllers: [_ | _]}) do
     raise ArgumentError, "a :cgroup configuration requires a :cgroup_path or :cgroup_base"
   end
 
+  defp validate_cgroup_has_path(%{stats_interval: _}) do
+    raise ArgumentError, ":stats_interval requires a :cgroup_path, :cgroup_base or :cgroup_pool"
+  end
+
+  defp validate_cgroup_has_path(%{pressure_triggers: _}) do
+    raise ArgumentError,
+          ":pressure_triggers requires a :cgroup_path, :cgroup_base or :cgroup_pool"
+  end
+
+  defp validate_cgroup_has_path(%{cgroup_events: true}) do
+    raise ArgumentError, ":cgroup_events requires a :cgroup_path, :cgroup_base or :cgroup_pool"
+  end
+
   defp validate_cgroup_has_path(other), do: other
 
+  # The kernel requires windows between 500 ms and 10 s
+  defp pressure_trigger?({resource, kind, stall_us, window_us})
+       when resource in [:memory, :cpu, :io] and kind in [:some, :full] and
+              is_integer(stall_us) and stall_us > 0 and is_integer(window_us) and
+              stall_us <= window_us and window_us in 500_000..10_000_000,
+       do: true
+
+  defp pressure_trigger?(_other), do: false
+
+  @doc false
+  @spec cgroup_base_path(String.t()) :: String.t()
+  def cgroup_base_path(base) do
+    # Create a random subfolder for this invocation
+    Path.join(base, random_string())
+  end
+
   # Thanks https://github.com/danhper/elixir-temp/blob/master/lib/temp.ex
   defp random_string() do
     Integer.to_string(:rand.uniform(0x100000000), 36) |> String.downcase()
@@ -129,6 +300,11 @@ defmodule MuonTrap.Options do
   defp validate_option(_any, {:env, enum}, opts),
     do: Map.put(opts, :env, validate_env(enum))
 
+  defp validate_option(:cmd, {:stderr_into, what}, opts), do: Map.put(opts, :stderr_into, what)
+
+  defp validate_option(:cmd, {:input, input}, opts) when is_binary(input) or is_list(input),
+    do: Map.put(opts, :input, IO.iodata_to_binary(input))
+
   # MuonTrap.Daemon options
   defp validate_option(:daemon, {:name, name}, opts),
     do: Map.put(opts, :name, name)
@@ -136,6 +312,61 @@ defmodule MuonTrap.Options do
   defp validate_option(:daemon, {:log_output, level}, opts) when level in @log_levels,
     do: Map.put(opts, :log_output, level)
 
+  defp validate_option(:daemon, {:stderr_log_output, level}, opts) when level in @log_levels,
+    do: Map.put(opts, :stderr_log_output, level)
+
+  defp validate_option(:daemon, {:forward_stdin, bool}, opts) when is_boolean(bool),
+    do: Map.put(opts, :forward_stdin, bool)
+
+  defp validate_option(:daemon, {:max_line_length, length}, opts)
+       when is_integer(length) and length > 0,
+       do: Map.put(opts, :max_line_length, length)
+
+  defp validate_option(:daemon, {:async_logging, value}, opts) when is_boolean(value),
+    do: Map.put(opts, :async_logging, value)
+
+  defp validate_option(:daemon, {:max_partial_line_length, length}, opts)
+       when is_integer(length) and length > 0,
+       do: Map.put(opts, :max_partial_line_length, length)
+
+  defp validate_option(:daemon, {:output_file, path}, opts) when is_binary(path),
+    do: Map.put(opts, :output_file, path)
+
+  defp validate_option(:daemon, {:output_file_max_bytes, count}, opts)
+       when is_integer(count) and count > 0,
+       do: Map.put(opts, :output_file_max_bytes, count)
+
+  defp validate_option(:daemon, {:output_file_keep, count}, opts)
+       when is_integer(count) and count >= 0,
+       do: Map.put(opts, :output_file_keep, count)
+
+  defp validate_option(:daemon, {:stats_interval, ms}, opts) when is_integer(ms) and ms > 0,
+    do: Map.put(opts, :stats_interval, ms)
+
+  defp validate_option(:daemon, {:stats_collector, collector}, opts) when is_atom(collector),
+    do: Map.put(opts, :stats_collector, collector)
+
+  # muontrap takes up to 6 triggers
+  defp validate_option(:daemon, {:pressure_triggers, triggers}, opts)
+       when is_list(triggers) and length(triggers) <= 6 do
+    if !Enum.all?(triggers, &pressure_trigger?/1) do
+      raise ArgumentError, "invalid :pressure_triggers #{inspect(triggers)}"
+    end
+
+    Map.put(opts, :pressure_triggers, triggers)
+  end
+
+  defp validate_option(:daemon, {:cgroup_events, value}, opts) when is_boolean(value),
+    do: Map.put(opts, :cgroup_events, value)
+
+  defp validate_option(:daemon, {:event_handler, handler}, opts)
+       when is_pid(handler) or is_atom(handler) or is_function(handler, 1),
+       do: Map.put(opts, :event_handler, handler)
+
+  defp validate_option(:daemon, {:tail_bytes, count}, opts)
+       when is_integer(count) and count > 0,
+       do: Map.put(opts, :tail_bytes, count)
+
   defp validate_option(:daemon, {:log_prefix, prefix}, opts) when is_binary(prefix),
     do: Map.put(opts, :log_prefix, prefix)
 
@@ -167,8 +398,39 @@ defmodule MuonTrap.Options do
   defp validate_option(_any, {:stdio_window, count}, opts) when is_integer(count),
     do: Map.put(opts, :stdio_window, count)
 
+  defp validate_option(_any, {:stdio_window, %Range{first: first, last: last}}, opts)
+       when is_integer(first) and is_integer(last) and first >= 16 and first <= last,
+       do: Map.put(opts, :stdio_window, first..last)
+
+  defp validate_option(_any, {:stdio_window, v}, _opts),
+    do:
+      raise(
+        ArgumentError,
+        "invalid option :stdio_window with value #{inspect(v)}, expected an integer or an increasing range starting at 16 or more"
+      )
+
+  defp validate_option(_any, {:pipe_size, size}, opts) when is_integer(size) and size > 0,
+    do: Map.put(opts, :pipe_size, size)
+
+  defp validate_option(_any, {:high_throughput, value}, opts) when is_boolean(value),
+    do: Map.put(opts, :high_throughput, value)
+
+  # Keep in sync with MAX_BATCH_BYTES in c_src/muontrap.c
+  defp validate_option(_any, {:batch_bytes, count}, opts)
+       when is_integer(count) and count > 0 and count <= 65_536,
+       do: Map.put(opts, :batch_bytes, count)
+
+  defp validate_option(_any, {:batch_usecs, usecs}, opts) when is_integer(usecs) and usecs > 0,
+    do: Map.put(opts, :batch_usecs, usecs)
+
+  defp validate_option(_any, {:resource_usage, bool}, opts) when is_boolean(bool),
+    do: Map.put(opts, :resource_usage, bool)
+
+  defp validate_option(_any, {:protocol, version}, opts) when version in [1, 2],
+    do: Map.put(opts, :protocol, version)
+
   defp validate_option(:daemon, {:exit_status_to_reason, exit_status_to_reason}, opts)
-       when is_function(exit_status_to_reason),
+       when is_function(exit_status_to_reason, 1) or is_function(exit_status_to_reason, 2),
        do: Map.put(opts, :exit_status_to_reason, exit_status_to_reason)
 
   defp validate_option(:daemon, {:wait_for, fun}, opts) when is_function(fun, 0),
@@ -198,6 +460,11 @@ defmodule MuonTrap.Options do
     Map.put(opts, :cgroup_base, path)
   end
 
+  defp validate_option(_any, {:cgroup_pool, pool}, opts)
+       when is_atom(pool) or is_pid(pool) or is_tuple(pool) do
+    Map.put(opts, :cgroup_pool, pool)
+  end
+
   defp validate_option(_any, {:delay_to_sigkill, delay}, opts) when is_integer(delay),
     do: Map.put(opts, :delay_to_sigkill, delay)
 
@@ -7,6 +7,51 @@
 defmodule MuonTrap.Port do
   @moduledoc false
 
+  # Protocol 2 packet types. See c_src/muontrap.c.
+  @packet_ack 1
+  @packet_output 2
+  @packet_window 3
+  @packet_stderr 4
+  @packet_line 5
+  @packet_stdin 6
+  @packet_stdin_eof 7
+  @packet_stdin_credit 8
+  @packet_tail 9
+  @packet_usage 10
+  @packet_stats 11
+  @packet_pressure 12
+  @packet_events 13
+
+  # Event file ids in EVENTS packets. See enum event_file in c_src/muontrap.c.
+  @event_names %{0 => :memory_events, 1 => :pids_events}
+
+  # Stat ids in STATS packets. See enum stat_id in c_src/muontrap.c.
+  @stat_names %{
+    1 => :memory_current,
+    2 => :pids_current,
+    3 => :cpu_usage_usec,
+    4 => :cpu_percent,
+    5 => :io_read_bytes,
+    6 => :io_write_bytes,
+    7 => :io_read_bytes_per_sec,
+    8 => :io_write_bytes_per_sec,
+    9 => :memory_pressure_avg10,
+    10 => :cpu_pressure_avg10,
+    11 => :io_pressure_avg10
+  }
+
+  # These are sent in hundredths
+  @percent_stats [4, 9, 10, 11]
+
+  # Keep in sync with DEFAULT_STDIN_WINDOW in c_src/muontrap.c
+  @stdin_window 65_536
+
+  # Stdin data has to fit in muontrap's 4 KB packet buffer
+  @max_stdin_packet_data 4000
+
+  # Keep in sync with DEFAULT_STDIO_WINDOW in c_src/muontrap.c
+  @default_stdio_window 10_240
+
   @spec muontrap_path() :: String.t()
   def muontrap_path() do
     Application.app_dir(:muontrap, ["priv", "muontrap"])
@@ -19,34 +64,159 @@ defmodule MuonTrap.Port do
   it works similarly.
   """
   @spec cmd(MuonTrap.Options.t()) ::
-          {Collectable.t(), exit_status :: non_neg_integer() | :timeout}
+          {Collectable.t() | {Collectable.t(), Collectable.t()},
+           exit_status :: non_neg_integer() | :timeout}
+          | {Collectable.t() | {Collectable.t(), Collectable.t()},
+             exit_status :: non_neg_integer() | :timeout, resource_usage :: map()}
   def cmd(options) do
-    opts = port_options(options, ["--capture-output"])
+    options = MuonTrap.CgroupPool.checkout_options(options)
+    cmd(options, port_options(options, ["--capture-output"]))
+  end
+
+  @doc false
+  @spec cmd(MuonTrap.Options.t(), list()) ::
+          {Collectable.t() | {Collectable.t(), Collectable.t()},
+           exit_status :: non_neg_integer() | :timeout}
+          | {Collectable.t() | {Collectable.t(), Collectable.t()},
+             exit_status :: non_neg_integer() | :timeout, resource_usage :: map()}
+  def cmd(options, opts) do
+    protocol = Map.get(options, :protocol, 1)
     {initial, fun} = Collectable.into(options.into)
+    stderr = stderr_collector(options)
     {maybe_timer, timeout_message} = maybe_start_timer(options[:timeout])
 
     try do
       port = Port.open({:spawn_executable, to_charlist(muontrap_path())}, opts)
-      do_cmd(port, initial, fun, timeout_message)
+
+      state = %{
+        acc: initial,
+        stderr: stderr,
+        stdin: start_input(port, options),
+        usage: %{},
+        ack_batch: Map.get(options, :batch_bytes),
+        unacked: 0
+      }
+
+      do_cmd(port, protocol, state, fun, timeout_message)
     catch
       kind, reason ->
         fun.(initial, :halt)
+        halt_collector(stderr)
         :erlang.raise(kind, reason, __STACKTRACE__)
     else
-      {acc, status} -> {fun.(acc, :done), status}
+      {state, status} ->
+        output = collected_output(state, fun)
+
+        if Map.get(options, :resource_usage),
+          do: {output, status, state.usage},
+          else: {output, status}
     after
       maybe_stop_timer(maybe_timer, timeout_message)
+      MuonTrap.CgroupPool.checkin_options(options)
     end
   end
 
-  defp do_cmd(port, acc, fun, timeout_message) do
+  @doc """
+  Stream a command's output, acknowledging it as the stream is consumed
+
+  See `MuonTrap.stream/3`.
+  """
+  @spec stream(MuonTrap.Options.t()) :: Enumerable.t()
+  def stream(options) do
+    Stream.resource(fn -> start_stream(options) end, &next_stream/1, &stop_stream/1)
+  end
+
+  defp start_stream(options) do
+    options = MuonTrap.CgroupPool.checkout_options(options)
+    opts = port_options(options, ["--capture-output"])
+    port = Port.open({:spawn_executable, to_charlist(muontrap_path())}, opts)
+
+    %{port: port, protocol: Map.get(options, :protocol, 1), options: options, unacked: 0}
+  end
+
+  defp next_stream(%{port: nil} = state), do: {:halt, state}
+
+  defp next_stream(%{port: port, protocol: protocol} = state) do
+    # Asking for the next element means that the consumer is done with the
+    # last one, so that's when muontrap is allowed to send more.
+    if state.unacked > 0, do: report_bytes_handled(port, state.unacked, protocol)
+
     receive do
-      {^port, {:data, data}} ->
-        report_bytes_handled(port, byte_size(data))
-        do_cmd(port, fun.(acc, {:cont, data}), fun, timeout_message)
+      {^port, {:data, message}} ->
+        case decode(protocol, message) do
+          {:output, data} -> {[data], %{state | unacked: byte_size(data)}}
+          _other -> next_stream(%{state | unacked: 0})
+        end
+
+      {^port, {:exit_status, _status}} ->
+        {:halt, %{state | port: nil}}
+
+      {:EXIT, ^port, reason} when reason != :normal ->
+        exit(reason)
+    end
+  end
+
+  # Closing the port closes muontrap's stdin, so it kills the command and
+  # cleans up its cgroup like it does when a MuonTrap.Daemon exits
+  defp stop_stream(state) do
+    if state.port, do: close_stream_port(state.port)
+    MuonTrap.CgroupPool.checkin_options(state.options)
+  end
+
+  defp close_stream_port(port) do
+    Port.close(port)
+    flush_port_messages(port)
+  rescue
+    # The command exited and the port closed before the exit status was read
+    ArgumentError -> flush_port_messages(port)
+  end
+
+  defp flush_port_messages(port) do
+    receive do
+      {^port, _message} -> flush_port_messages(port)
+    after
+      0 -> :ok
+    end
+  end
+
+  defp collected_output(%{acc: acc, stderr: nil}, fun), do: fun.(acc, :done)
+
+  defp collected_output(%{acc: acc, stderr: {stderr_acc, stderr_fun}}, fun),
+    do: {fun.(acc, :done), stderr_fun.(stderr_acc, :done)}
+
+  defp stderr_collector(%{stderr_into: into}), do: Collectable.into(into)
+  defp stderr_collector(_options), do: nil
+
+  defp halt_collector(nil), do: :ok
+  defp halt_collector({acc, fun}), do: fun.(acc, :halt)
+
+  defp start_input(port, %{input: input}), do: feed_input(port, {input, @stdin_window})
+  defp start_input(_port, _options), do: nil
+
+  # Send as much input as there's credit for and close stdin after the last of it
+  defp feed_input(port, {data, credit}) do
+    case send_stdin(port, data, credit) do
+      {"", _credit} ->
+        close_stdin(port)
+        nil
+
+      remaining ->
+        remaining
+    end
+  end
+
+  # The state holds the stdout collectable's accumulator, the stderr collector
+  # when stderr is kept separate, the input and stdin credit that are left
+  # when there's input, the resource usage once muontrap reports it, and the
+  # output that hasn't been acknowledged yet with :batch_bytes.
+  defp do_cmd(port, protocol, state, fun, timeout_message) do
+    receive do
+      {^port, {:data, message}} ->
+        state = handle_cmd_message(port, protocol, decode(protocol, message), state, fun)
+        do_cmd(port, protocol, state, fun, timeout_message)
 
       {^port, {:exit_status, status}} ->
-        {acc, status}
+        {state, status}
 
       # Port died abnormally (only received when the caller traps exits). No
       # :exit_status will arrive, so exit with the port's reason rather than
@@ -56,10 +226,59 @@ defmodule MuonTrap.Port do
 
       ^timeout_message ->
         Port.close(port)
-        {acc, :timeout}
+        {state, :timeout}
+    after
+      # Held acknowledgments go out once the messages that are waiting are handled
+      ack_timeout(state) ->
+        report_bytes_handled(port, state.unacked, protocol)
+        do_cmd(port, protocol, %{state | unacked: 0}, fun, timeout_message)
     end
   end
 
+  defp ack_timeout(%{unacked: 0}), do: :infinity
+  defp ack_timeout(_state), do: 0
+
+  # With :batch_bytes, hold acknowledgments until there's that much output to
+  # acknowledge or until there are no more messages from the port waiting
+  defp acknowledge(port, protocol, %{ack_batch: nil} = state, count) do
+    report_bytes_handled(port, count, protocol)
+    state
+  end
+
+  defp acknowledge(port, protocol, state, count) do
+    unacked = state.unacked + count
+
+    if unacked >= state.ack_batch do
+      report_bytes_handled(port, unacked, protocol)
+      %{state | unacked: 0}
+    else
+      %{state | unacked: unacked}
+    end
+  end
+
+  defp handle_cmd_message(port, protocol, {:output, data}, state, fun) do
+    state = acknowledge(port, protocol, state, byte_size(data))
+    %{state | acc: fun.(state.acc, {:cont, data})}
+  end
+
+  defp handle_cmd_message(port, protocol, {:stderr, data}, state, _fun) do
+    state = acknowledge(port, protocol, state, byte_size(data))
+    {stderr_acc, stderr_fun} = state.stderr
+    %{state | stderr: {stderr_fun.(stderr_acc, {:cont, data}), stderr_fun}}
+  end
+
+  defp handle_cmd_message(port, _protocol, {:stdin_credit, count}, state, _fun) do
+    case state.stdin do
+      {data, credit} -> %{state | stdin: feed_input(port, {data, credit + count})}
+      nil -> state
+    end
+  end
+
+  defp handle_cmd_message(_port, _protocol, {:resource_usage, usage}, state, _fun),
+    do: %{state | usage: usage}
+
+  defp handle_cmd_message(_port, _protocol, _other, state, _fun), do: state
+
   @spec port_options(MuonTrap.Options.t(), [String.t()]) :: list()
   def port_options(options, args \\ []) do
     [
@@ -71,20 +290,60 @@ defmodule MuonTrap.Port do
     ]
   end
 
+  @doc false
+  @spec put_args(list(), MuonTrap.Options.t()) :: list()
+  def put_args(port_options, options) do
+    {:args, args} = List.keyfind(port_options, :args, 0)
+    args = Enum.flat_map(options, &muontrap_arg/1) ++ args
+    List.keyreplace(port_options, :args, 0, {:args, args})
+  end
+
   defp muontrap_args(options) do
     Enum.flat_map(options, &muontrap_arg/1) ++ ["--", options.cmd] ++ options.args
   end
 
   defp muontrap_arg({:cgroup_path, path}), do: ["--group", path]
+  defp muontrap_arg({:reuse_cgroup, true}), do: ["--reuse-group"]
   defp muontrap_arg({:delay_to_sigkill, delay}), do: ["--delay-to-sigkill", to_string(delay)]
   defp muontrap_arg({:uid, id}), do: ["--uid", to_string(id)]
   defp muontrap_arg({:gid, id}), do: ["--gid", to_string(id)]
   defp muontrap_arg({:groups, groups}), do: ["--groups", Enum.map_join(groups, ",", &to_string/1)]
   defp muontrap_arg({:arg0, arg0}), do: ["--arg0", arg0]
+
+  defp muontrap_arg({:stdio_window, %Range{first: first, last: last}}),
+    do: ["--stdio-window-min", to_string(first), "--stdio-window-max", to_string(last)]
+
   defp muontrap_arg({:stdio_window, count}), do: ["--stdio-window", to_string(count)]
+  defp muontrap_arg({:protocol, 2}), do: ["--protocol", "2"]
+  defp muontrap_arg({:max_line_length, length}), do: ["--line-max", to_string(length)]
+  defp muontrap_arg({:input, _input}), do: ["--forward-stdin"]
+  defp muontrap_arg({:forward_stdin, true}), do: ["--forward-stdin"]
+  defp muontrap_arg({:tail_bytes, count}), do: ["--tail-bytes", to_string(count)]
+  defp muontrap_arg({:resource_usage, true}), do: ["--resource-usage"]
+  defp muontrap_arg({:pipe_size, size}), do: ["--pipe-size", to_string(size)]
+  defp muontrap_arg({:batch_bytes, count}), do: ["--batch-bytes", to_string(count)]
+  defp muontrap_arg({:batch_usecs, usecs}), do: ["--batch-usecs", to_string(usecs)]
+  defp muontrap_arg({:cgroup_events, true}), do: ["--cgroup-events"]
+  defp muontrap_arg({:stats_interval, ms}), do: ["--stats-interval", to_string(ms)]
+
+  defp muontrap_arg({:pressure_triggers, triggers}) do
+    Enum.flat_map(triggers, fn {resource, kind, stall_us, window_us} ->
+      ["--pressure-trigger", "#{resource}:#{kind}:#{stall_us}:#{window_us}"]
+    end)
+  end
+
+  defp muontrap_arg({:output_file, path}), do: ["--output-file", path]
+
+  defp muontrap_arg({:output_file_max_bytes, count}),
+    do: ["--output-file-max-bytes", to_string(count)]
+
+  defp muontrap_arg({:output_file_keep, count}), do: ["--output-file-keep", to_string(count)]
   defp muontrap_arg({:stderr_to_stdout, true}), do: ["--capture-stderr"]
   defp muontrap_arg({:capture_stderr_only, true}), do: ["--capture-stderr-only"]
 
+  defp muontrap_arg({stderr_opt, _}) when stderr_opt in [:stderr_into, :stderr_log_output],
+    do: ["--separate-stderr"]
+
   defp muontrap_arg({log_opt, _}) when log_opt in [:log_output, :logger_fun],
     do: ["--capture-output"]
 
@@ -104,11 +363,125 @@ defmodule MuonTrap.Port do
   defp port_option({:cd, bin}), do: [{:cd, bin}]
   defp port_option({:arg0, bin}), do: [{:arg0, bin}]
   defp port_option({:parallelism, bool}), do: [{:parallelism, bool}]
+  defp port_option({:protocol, 2}), do: [{:packet, 4}]
   defp port_option(_other), do: []
 
-  @spec report_bytes_handled(port(), pos_integer()) :: :ok
-  def report_bytes_handled(port, count) when is_port(port) and is_integer(count) do
-    cmd = encode_acks(count)
+  @doc """
+  Decode a message from the port
+
+  Protocol 1 only carries output. Protocol 2 messages are packets whose first
+  byte says what's in them.
+  """
+  @spec decode(1 | 2, binary()) ::
+          {:output, binary()}
+          | {:stderr, binary()}
+          | {:line, :stdout | :stderr, binary(), truncated :: boolean()}
+          | {:window, pos_integer()}
+          | {:stdin_credit, non_neg_integer()}
+          | {:tail, binary()}
+          | {:resource_usage, map()}
+          | {:stats, elapsed_ms :: non_neg_integer(), %{optional(atom()) => number()}}
+          | {:pressure, index :: non_neg_integer(), %{optional(String.t()) => map()}}
+          | {:cgroup_events, atom(), %{optional(String.t()) => non_neg_integer()}}
+  def decode(1, data), do: {:output, data}
+  def decode(2, <<@packet_output, data::binary>>), do: {:output, data}
+  def decode(2, <<@packet_stderr, data::binary>>), do: {:stderr, data}
+  def decode(2, <<@packet_window, size::32>>), do: {:window, size}
+  def decode(2, <<@packet_stdin_credit, count::32>>), do: {:stdin_credit, count}
+  def decode(2, <<@packet_tail, tail::binary>>), do: {:tail, tail}
+
+  def decode(2, <<@packet_usage, entries::binary>>),
+    do: {:resource_usage, MuonTrap.Cgroups.parse_usage(decode_usage_entries(entries, []))}
+
+  # Line flags are 0x01 for stderr and 0x02 for truncated
+  def decode(2, <<@packet_line, _::6, truncated::1, stderr::1, line::binary>>) do
+    stream = if stderr == 1, do: :stderr, else: :stdout
+    {:line, stream, line, truncated == 1}
+  end
+
+  def decode(2, <<@packet_pressure, index, pressure::binary>>),
+    do: {:pressure, index, MuonTrap.Cgroups.parse_pressure(pressure)}
+
+  def decode(2, <<@packet_events, id, counts::binary>>),
+    do: {:cgroup_events, @event_names[id], MuonTrap.Cgroups.parse_flat_keyed(counts)}
+
+  def decode(2, <<@packet_stats, elapsed::32, stats::binary>>),
+    do: {:stats, elapsed, decode_stats(stats, %{})}
+
+  defp decode_stats(<<id, value::64, rest::binary>>, acc) when id in @percent_stats,
+    do: decode_stats(rest, Map.put(acc, @stat_names[id], value / 100))
+
+  defp decode_stats(<<id, value::64, rest::binary>>, acc) do
+    case @stat_names do
+      %{^id => name} -> decode_stats(rest, Map.put(acc, name, value))
+      _unknown -> decode_stats(rest, acc)
+    end
+  end
+
+  defp decode_stats(_rest, acc), do: acc
+
+  defp decode_usage_entries(
+         <<name_size, name::binary-size(name_size), size::32, data::binary-size(size),
+           rest::binary>>,
+         acc
+       ),
+       do: decode_usage_entries(rest, [{name, data} | acc])
+
+  defp decode_usage_entries(_rest, acc), do: acc
+
+  @doc """
+  Return the stdio window that muontrap starts with
+
+  Adaptive windows start at the default size limited to their range.
+  """
+  @spec initial_stdio_window(MuonTrap.Options.t()) :: pos_integer()
+  def initial_stdio_window(%{stdio_window: %Range{first: first, last: last}}),
+    do: @default_stdio_window |> max(first) |> min(last)
+
+  def initial_stdio_window(%{stdio_window: count}), do: max(count, 16)
+  def initial_stdio_window(_options), do: @default_stdio_window
+
+  @doc """
+  Return how many bytes of stdin data muontrap can buffer
+
+  This is the stdin credit that a command starts with.
+  """
+  @spec stdin_window() :: pos_integer()
+  def stdin_window(), do: @stdin_window
+
+  @doc """
+  Send as much of `data` to the command's stdin as `credit` allows
+
+  Returns the data that's still left to send and the remaining credit.
+  """
+  @spec send_stdin(port(), binary(), non_neg_integer()) :: {binary(), non_neg_integer()}
+  def send_stdin(port, data, credit) when credit > 0 and byte_size(data) > 0 do
+    size = data |> byte_size() |> min(credit) |> min(@max_stdin_packet_data)
+    <<chunk::binary-size(size), rest::binary>> = data
+    _ = Port.command(port, [@packet_stdin, chunk])
+    send_stdin(port, rest, credit - size)
+  rescue
+    # The port closed, so there's nowhere to send the data
+    ArgumentError -> {"", credit}
+  end
+
+  def send_stdin(_port, data, credit), do: {data, credit}
+
+  @doc """
+  Close the command's stdin once muontrap has written everything sent so far
+  """
+  @spec close_stdin(port()) :: :ok
+  def close_stdin(port) do
+    _ = Port.command(port, <<@packet_stdin_eof>>)
+    :ok
+  rescue
+    ArgumentError -> :ok
+  end
+
+  @spec report_bytes_handled(port(), pos_integer(), 1 | 2) :: :ok
+  def report_bytes_handled(port, count, protocol \\ 1)
+      when is_port(port) and is_integer(count) do
+    cmd = if protocol == 2, do: encode_credit(count), else: encode_acks(count)
     _ = Port.command(port, cmd)
     :ok
   rescue
@@ -134,6 +507,11 @@ defmodule MuonTrap.Port do
   defp encode_acks_helper(full_acks, partial_acks),
     do: [:binary.copy(<<255>>, full_acks), partial_acks - 1]
 
+  # Protocol 2 acknowledges any number of bytes with one packet. The port adds
+  # the 4-byte length.
+  @spec encode_credit(pos_integer()) :: binary()
+  def encode_credit(count) when count > 0, do: <<@packet_ack, count::32>>
+
   @spec maybe_start_timer(non_neg_integer() | nil) :: {reference() | nil, {:timeout, reference()}}
   defp maybe_start_timer(timeout) when is_integer(timeout) do
     timeout_message = {:timeout, make_ref()}
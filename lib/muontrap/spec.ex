@@ -0,0 +1,109 @@
+# SPDX-FileCopyrightText: 2025 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule MuonTrap.Spec do
+  @moduledoc """
+  A command and its options that have been checked once to run many times
+
+  `MuonTrap.cmd/3` and `MuonTrap.Daemon` validate their options, look up the
+  executable, translate the cgroup settings and build muontrap's arguments
+  each time that they run a command. A spec does that once. Launching it only
+  picks a cgroup when the command needs a new one.
+
+  Compile a spec for `MuonTrap.cmd/1`:
+
+  ```elixir
+  iex> spec = MuonTrap.Spec.new(:cmd, "echo", ["hello"])
+  iex> MuonTrap.cmd(spec)
+  {"hello\\n", 0}
+  iex> MuonTrap.cmd(spec)
+  {"hello\\n", 0}
+  ```
+
+  Or for a `MuonTrap.Daemon`. This also saves the work each time a supervisor
+  restarts it:
+
+  ```elixir
+  spec = MuonTrap.Spec.new(:daemon, "my_server", [], log_output: :info)
+
+  children = [
+    {MuonTrap.Daemon, spec}
+  ]
+  ```
+
+  Each launch of a spec with a `:cgroup_base` runs in a new randomly named
+  cgroup just like separate `MuonTrap.cmd/3` calls do. Each launch of a spec
+  with a `:cgroup_pool` gets a cgroup from the pool.
+  """
+
+  alias MuonTrap.Options
+
+  defstruct [:context, :command, :args, :options, :port_options]
+
+  @opaque t() :: %__MODULE__{
+            context: :cmd | :daemon,
+            command: binary(),
+            args: [binary()],
+            options: Options.t(),
+            port_options: list()
+          }
+
+  @doc """
+  Validate a command and its options
+
+  Pass `:cmd` for a spec to run with `MuonTrap.cmd/1` and `:daemon` for one
+  to start with `MuonTrap.Daemon`. The options are the same as the ones for
+  `MuonTrap.cmd/3` or `MuonTrap.Daemon.start_link/3`. This raises the same
+  errors that they do.
+  """
+  @spec new(:cmd | :daemon, binary(), [binary()], keyword()) :: t()
+  def new(context, command, args, opts \\ []) when is_binary(command) and is_list(args) do
+    options = Options.validate(context, command, args, opts)
+
+    # The path that validate picked for a :cgroup_base is only for one launch
+    launch_options =
+      if Map.has_key?(options, :cgroup_base), do: Map.delete(options, :cgroup_path), else: options
+
+    %__MODULE__{
+      context: context,
+      command: command,
+      args: args,
+      options: options,
+      port_options: MuonTrap.Port.port_options(launch_options, launch_args(context))
+    }
+  end
+
+  defp launch_args(:cmd), do: ["--capture-output"]
+  defp launch_args(:daemon), do: []
+
+  @doc false
+  @spec launch(t()) :: {Options.t(), list()}
+  def launch(%__MODULE__{options: %{cgroup_base: base}} = spec) do
+    cgroup_options = %{cgroup_path: Options.cgroup_base_path(base)}
+
+    {Map.merge(spec.options, cgroup_options),
+     MuonTrap.Port.put_args(spec.port_options, cgroup_options)}
+  end
+
+  def launch(%__MODULE__{options: %{cgroup_pool: _pool}} = spec) do
+    options = MuonTrap.CgroupPool.checkout_options(spec.options)
+    lease_options = Map.drop(options, Map.keys(spec.options))
+
+    {options, MuonTrap.Port.put_args(spec.port_options, lease_options)}
+  end
+
+  def launch(spec), do: {spec.options, spec.port_options}
+
+  @doc false
+  @spec context(t()) :: :cmd | :daemon
+  def context(%__MODULE__{context: context}), do: context
+
+  @doc false
+  @spec name(t()) :: GenServer.name() | nil
+  def name(%__MODULE__{options: options}), do: Map.get(options, :name)
+
+  @doc false
+  @spec command(t()) :: {binary(), [binary()]}
+  def command(%__MODULE__{command: command, args: args}), do: {command, args}
+end
@@ -0,0 +1,124 @@
+# SPDX-FileCopyrightText: 2025 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule MuonTrap.StatsCollector do
+  @moduledoc """
+  Read the cgroup statistics for many daemons at once
+
+  `MuonTrap.Daemon.statistics/1` reads the cgroup's stat files each time
+  it's called and goes through the daemon's mailbox to do it. When there are
+  many daemons or many callers, a collector reads the stat files for every
+  daemon that's registered with it in one sweep and caches the results in an
+  ETS table. Callers read the table directly.
+
+  Start a collector under your supervision tree:
+
+  ```elixir
+  children = [
+    {MuonTrap.StatsCollector, name: MyApp.StatsCollector, ttl: 1000},
+    ...
+  ]
+  ```
+
+  Then pass `stats_collector: MyApp.StatsCollector` to each
+  `MuonTrap.Daemon` that runs in a cgroup. Daemons are removed from the
+  collector when they exit.
+
+  Options:
+
+  * `:name` - the name to register the collector and its ETS table under.
+    Defaults to `MuonTrap.StatsCollector`.
+  * `:ttl` - how often to read the stat files in milliseconds. Defaults to
+    1000.
+  """
+  use GenServer
+
+  alias MuonTrap.Cgroups
+
+  @doc """
+  Start a stats collector
+  """
+  @spec start_link(keyword()) :: GenServer.on_start()
+  def start_link(opts \\ []) do
+    name = Keyword.get(opts, :name, __MODULE__)
+    GenServer.start_link(__MODULE__, Keyword.put(opts, :name, name), name: name)
+  end
+
+  @doc """
+  Add the calling process's cgroup to the collector
+
+  `MuonTrap.Daemon` calls this when it has a `:stats_collector`. The
+  statistics are read right away so that they're available when this
+  returns.
+  """
+  @spec register(atom(), String.t()) :: :ok
+  def register(collector \\ __MODULE__, cgroup_path) do
+    GenServer.call(collector, {:register, self(), cgroup_path})
+  end
+
+  @doc """
+  Return the cached cgroup statistics for a daemon
+
+  See `MuonTrap.Daemon.statistics/1` for what's in them. Returns an empty map
+  if the daemon isn't registered.
+  """
+  @spec statistics(atom(), GenServer.server()) :: %{optional(String.t()) => term()}
+  def statistics(collector \\ __MODULE__, daemon) do
+    case :ets.lookup(collector, GenServer.whereis(daemon)) do
+      [{_pid, stats}] -> stats
+      [] -> %{}
+    end
+  end
+
+  @doc """
+  Return the cached cgroup statistics for all registered daemons
+  """
+  @spec all(atom()) :: %{pid() => %{optional(String.t()) => term()}}
+  def all(collector \\ __MODULE__) do
+    Map.new(:ets.tab2list(collector))
+  end
+
+  @impl GenServer
+  def init(opts) do
+    table = :ets.new(Keyword.fetch!(opts, :name), [:named_table, read_concurrency: true])
+    ttl = Keyword.get(opts, :ttl, 1000)
+
+    Process.send_after(self(), :sweep, ttl)
+
+    {:ok, %{table: table, ttl: ttl, daemons: %{}}}
+  end
+
+  @impl GenServer
+  def handle_call({:register, pid, cgroup_path}, _from, state) do
+    case Map.fetch(state.daemons, pid) do
+      {:ok, {ref, _path}} -> Process.demonitor(ref, [:flush])
+      :error -> :ok
+    end
+
+    ref = Process.monitor(pid)
+    :ets.insert(state.table, {pid, Cgroups.statistics(cgroup_path)})
+
+    {:reply, :ok, %{state | daemons: Map.put(state.daemons, pid, {ref, cgroup_path})}}
+  end
+
+  @impl GenServer
+  def handle_info(:sweep, state) do
+    entries =
+      Enum.map(state.daemons, fn {pid, {_ref, cgroup_path}} ->
+        {pid, Cgroups.statistics(cgroup_path)}
+      end)
+
+    :ets.insert(state.table, entries)
+
+    # Scheduling the next sweep after this one finishes keeps sweeps from
+    # piling up when they take longer than the ttl
+    Process.send_after(self(), :sweep, state.ttl)
+    {:noreply, state}
+  end
+
+  def handle_info({:DOWN, _ref, :process, pid, _reason}, state) do
+    :ets.delete(state.table, pid)
+    {:noreply, %{state | daemons: Map.delete(state.daemons, pid)}}
+  end
+end
@@ -0,0 +1,48 @@
+# SPDX-FileCopyrightText: 2025 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule MuonTrap.BatchTest do
+  use MuonTrapTest.Case
+
+  doctest MuonTrap.Batch
+
+  test "runs commands with per-command options" do
+    results =
+      MuonTrap.Batch.run(
+        [
+          {"sh", ["-c", "echo $FOO"]},
+          {"sh", ["-c", "echo $FOO"], env: [{"FOO", "override"}]},
+          {"sh", ["-c", "echo $FOO >&2"], stderr_to_stdout: true}
+        ],
+        env: [{"FOO", "batch"}]
+      )
+
+    assert [{"batch\n", 0, usage}, {"override\n", 0, _}, {"batch\n", 0, _}] = results
+    assert %{"rusage" => %{"utime_usec" => _}} = usage
+  end
+
+  test "limits how many commands run at once" do
+    {usec, results} =
+      :timer.tc(fn ->
+        MuonTrap.Batch.run(List.duplicate({"sleep", ["0.2"]}, 4), max_concurrency: 2)
+      end)
+
+    assert Enum.all?(results, &match?({"", 0, _}, &1))
+    assert usec >= 400_000
+  end
+
+  test "rejects bad options" do
+    assert_raise ArgumentError, fn -> MuonTrap.Batch.run([{"echo", [:hello]}]) end
+    assert_raise ArgumentError, fn -> MuonTrap.Batch.run([], cgroup: %{memory_max: 1}) end
+
+    assert_raise ArgumentError, fn ->
+      MuonTrap.Batch.run([{"echo", []}], cgroup_base: "muontrap_test", cgroup: %{})
+    end
+
+    assert_raise ArgumentError, fn ->
+      opts = [cgroup_base: "muontrap_test", cgroup: %{memory_max: 268_435_456}]
+      MuonTrap.Batch.run([{"echo", [], cgroup_path: "x"}], opts)
+    end
+  end
+end
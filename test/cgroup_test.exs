@@ -59,6 +59,56 @@ defmodule CgroupTest do
     assert !cpu_cgroup_exists(cgroup_path)
   end
 
+  @tag :cgroup
+  test "cgroup pool doesn't reuse a cgroup that a lease changed" do
+    base = random_cgroup_path()
+    File.mkdir_p!(Path.join("/sys/fs/cgroup", base))
+
+    pool =
+      start_supervised!(
+        {MuonTrap.CgroupPool, cgroup_base: base, cgroup: %{memory_max: 268_435_456}, size: 1}
+      )
+
+    daemon = start_supervised!({MuonTrap.Daemon, ["sleep", ["100"], [cgroup_pool: pool]]})
+    path = MuonTrap.Daemon.cgroup_path(daemon)
+    :ok = MuonTrap.Daemon.cgset(daemon, "memory.high", "100000000")
+    :ok = stop_supervised(MuonTrap.Daemon)
+
+    # The next command gets a new cgroup without the change
+    script = "cat /sys/fs/cgroup$(sed -n s/^0:://p /proc/self/cgroup)/memory.high"
+    assert {"max\n", 0} = MuonTrap.cmd("sh", ["-c", script], cgroup_pool: pool)
+    assert %{free: [other], leased: []} = MuonTrap.CgroupPool.info(pool)
+    assert other != path
+
+    # The changed one is removed once muontrap is done with it
+    assert Enum.any?(1..20, fn _ ->
+             wait_for_close_check(50)
+             !memory_cgroup_exists(path)
+           end)
+  end
+
+  test "cgroup pool needs a cgroup setting" do
+    Process.flag(:trap_exit, true)
+
+    assert {:error, {%ArgumentError{}, _stacktrace}} =
+             MuonTrap.CgroupPool.start_link(cgroup_base: "muontrap_test", cgroup: %{})
+  end
+
+  @tag :cgroup
+  test "halting a stream removes its cgroup" do
+    cgroup_path = random_cgroup_path()
+
+    assert ["hello\n"] =
+             MuonTrap.stream("/bin/sh", ["-c", "echo hello; exec sleep 100"],
+               cgroup_path: cgroup_path,
+               cgroup: %{cpu_weight: 100}
+             )
+             |> Enum.take(1)
+
+    wait_for_close_check()
+    assert !cpu_cgroup_exists(cgroup_path)
+  end
+
   @tag :cgroup
   test "get and set cgroup variables" do
     cgroup_path = random_cgroup_path()
@@ -90,4 +140,125 @@ defmodule CgroupTest do
 
     Port.close(port)
   end
+
+  @tag :cgroup
+  test "cgroup pool reuses cgroups" do
+    base = random_cgroup_path()
+    File.mkdir_p!(Path.join("/sys/fs/cgroup", base))
+
+    pool =
+      start_supervised!(
+        {MuonTrap.CgroupPool, cgroup_base: base, cgroup: %{memory_max: 268_435_456}, size: 1}
+      )
+
+    %{free: [path]} = MuonTrap.CgroupPool.info(pool)
+    assert memory_cgroup_exists(path)
+
+    for _ <- 1..3 do
+      assert {"268435456\n", 0} =
+               MuonTrap.cmd("cat", ["/sys/fs/cgroup/#{path}/memory.max"], cgroup_pool: pool)
+
+      assert memory_cgroup_exists(path)
+      assert MuonTrap.CgroupPool.info(pool) == %{free: [path], leased: []}
+    end
+
+    # A daemon gets its own cgroup and returns it when it exits
+    daemon = start_supervised!({MuonTrap.Daemon, ["sleep", ["100"], [cgroup_pool: pool]]})
+    assert MuonTrap.Daemon.cgroup_path(daemon) == path
+    assert MuonTrap.CgroupPool.info(pool) == %{free: [], leased: [path]}
+
+    {"", 0} = MuonTrap.cmd("true", [], cgroup_pool: pool)
+    assert %{free: [other], leased: [^path]} = MuonTrap.CgroupPool.info(pool)
+    assert other != path
+
+    :ok = stop_supervised(MuonTrap.Daemon)
+    assert %{free: free, leased: []} = MuonTrap.CgroupPool.info(pool)
+    assert Enum.sort(free) == Enum.sort([path, other])
+
+    :ok = stop_supervised(MuonTrap.CgroupPool)
+    refute File.exists?(Path.join("/sys/fs/cgroup", other))
+  end
+
+  @tag :cgroup
+  test "batch commands share the batch's cgroup limits" do
+    base = random_cgroup_path()
+    File.mkdir_p!(Path.join("/sys/fs/cgroup", base))
+
+    # Each command reads memory.max from the parent of its own cgroup
+    script = "cat /sys/fs/cgroup$(dirname $(sed -n s/^0:://p /proc/self/cgroup))/memory.max"
+
+    results =
+      MuonTrap.Batch.run(List.duplicate({"sh", ["-c", script]}, 3),
+        cgroup_base: base,
+        cgroup: %{memory_max: 268_435_456}
+      )
+
+    assert Enum.all?(results, &match?({"268435456\n", 0, _usage}, &1))
+    assert File.ls!(Path.join("/sys/fs/cgroup", base)) |> Enum.filter(&(&1 =~ "batch")) == []
+  end
+
+  @tag :cgroup
+  test "batch cgroup is removed when a command crashes" do
+    base = random_cgroup_path()
+    File.mkdir_p!(Path.join("/sys/fs/cgroup", base))
+
+    # Output can't go into a map, so the first command's task crashes while
+    # the second one is still running
+    commands = [{"echo", ["hello"], into: %{}}, {"sleep", ["100"]}]
+
+    catch_exit(
+      MuonTrap.Batch.run(commands,
+        max_concurrency: 2,
+        cgroup_base: base,
+        cgroup: %{memory_max: 268_435_456}
+      )
+    )
+
+    assert File.ls!(Path.join("/sys/fs/cgroup", base)) |> Enum.filter(&(&1 =~ "batch")) == []
+  end
+
+  @tag :cgroup
+  test "daemon statistics come from muontrap's samples" do
+    {:ok, pid} =
+      start_supervised(
+        {MuonTrap.Daemon,
+         ["sh", ["-c", "while true; do :; done"],
+          [cgroup_base: "muontrap_test", cgroup: %{cpu_weight: 100}, stats_interval: 50]]}
+      )
+
+    Process.sleep(300)
+
+    sample = MuonTrap.Daemon.sampled_statistics(pid)
+    assert sample.cpu_usage_usec > 0
+    assert sample.cpu_percent > 10
+
+    # statistics/1 still reads the stat files
+    assert %{cgroup: %{"cpu.stat" => %{"usage_usec" => _}}} = MuonTrap.Daemon.statistics(pid)
+
+    :ok = stop_supervised(MuonTrap.Daemon)
+  end
+
+  @tag :cgroup
+  test "stats collector caches daemon statistics" do
+    collector = start_supervised!({MuonTrap.StatsCollector, name: :test_collector, ttl: 50})
+
+    opts = [
+      cgroup_base: "muontrap_test",
+      cgroup: %{cpu_weight: 100},
+      stats_collector: :test_collector
+    ]
+
+    pid = start_supervised!({MuonTrap.Daemon, ["sleep", ["100"], opts]})
+
+    assert %{"cpu.stat" => %{"usage_usec" => _}} =
+             MuonTrap.StatsCollector.statistics(:test_collector, pid)
+
+    assert [^pid] = Map.keys(MuonTrap.StatsCollector.all(:test_collector))
+
+    :ok = stop_supervised(MuonTrap.Daemon)
+
+    # The collector drops the daemon when it exits
+    _ = :sys.get_state(collector)
+    assert MuonTrap.StatsCollector.statistics(:test_collector, pid) == %{}
+  end
 end
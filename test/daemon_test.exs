@@ -243,6 +243,47 @@ defmodule DaemonTest do
     refute_receive _
   end
 
+  test "async logging keeps the daemon responsive" do
+    test_process = self()
+
+    logger = fn line ->
+      Process.sleep(100)
+      send(test_process, {:logged, line})
+    end
+
+    {:ok, pid} =
+      start_supervised(
+        daemon_spec("sh", ["-c", "echo one; echo two; echo three; sleep 10"],
+          logger_fun: logger,
+          async_logging: true
+        )
+      )
+
+    # The daemon answers while lines are still being logged
+    assert_receive {:logged, "one"}, 500
+    assert %{output_byte_count: 14} = Daemon.statistics(pid)
+    refute_received {:logged, "three"}
+
+    assert_receive {:logged, "two"}, 500
+    assert_receive {:logged, "three"}, 500
+  end
+
+  test "async log consumer exits with the daemon" do
+    for stop <- [&GenServer.stop/1, &Process.exit(&1, :kill)] do
+      {:ok, pid} =
+        start_supervised(
+          daemon_spec("sleep", ["10"], log_output: :debug, async_logging: true),
+          restart: :temporary
+        )
+
+      consumer = :sys.get_state(pid).log_consumer
+      ref = Process.monitor(consumer)
+
+      stop.(pid)
+      assert_receive {:DOWN, ^ref, :process, ^consumer, _reason}, 500
+    end
+  end
+
   test "daemon supports custom logger (mfa)" do
     fun = fn ->
       {:ok, pid} =
@@ -447,6 +488,131 @@ defmodule DaemonTest do
     assert log =~ "Process exited with status"
   end
 
+  @tag :tmp_dir
+  test "writes output to a rotated file", %{tmp_dir: tmp_dir} do
+    path = Path.join(tmp_dir, "out.log")
+
+    {:ok, pid} =
+      start_supervised(
+        daemon_spec("sh", ["-c", "seq 1 1000; sleep 100"],
+          output_file: path,
+          output_file_max_bytes: 1000,
+          output_file_keep: 2
+        )
+      )
+
+    wait_for_file = fn wait ->
+      case File.read(path) do
+        {:ok, contents} when byte_size(contents) == 893 ->
+          :ok
+
+        _ ->
+          Process.sleep(10)
+          wait.(wait)
+      end
+    end
+
+    wait_for_file.(wait_for_file)
+
+    # seq prints 3893 bytes, so the first 1000 are in the file that was dropped
+    assert File.read!(path <> ".2") <> File.read!(path <> ".1") <> File.read!(path) ==
+             Enum.map_join(1..1000, &"#{&1}\n") |> binary_part(1000, 2893)
+
+    refute File.exists?(path <> ".3")
+    assert Daemon.statistics(pid).output_byte_count == 0
+
+    :ok = stop_supervised(:test_daemon)
+  end
+
+  test "logs resource usage at exit" do
+    log =
+      capture_log(fn ->
+        {:ok, pid} =
+          start_supervised({Daemon, ["sh", ["-c", "exit 0"], [resource_usage: true]]},
+            restart: :transient
+          )
+
+        ref = Process.monitor(pid)
+        assert_receive {:DOWN, ^ref, :process, _object, :normal}, 1000
+      end)
+
+    assert log =~ ~r/Process exited successfully \(cpu \d+ ms, max rss \d+ KB\)/
+  end
+
+  test "stop reason includes the output tail" do
+    log =
+      capture_log(fn ->
+        {:ok, pid} =
+          start_supervised(
+            daemon_spec("sh", ["-c", "seq 1 1000; exit 3"], tail_bytes: 9, stderr_to_stdout: true)
+          )
+
+        ref = Process.monitor(pid)
+        assert_receive {:DOWN, ^ref, :process, _object, {:error_exit_status, tail}}, 1000
+        assert tail == "998\n999\n1000\n"
+
+        :ok = stop_supervised(:test_daemon)
+      end)
+
+    assert log =~ "Process exited with status 3"
+  end
+
+  test "output tail is passed to a 2-arity exit_status_to_reason" do
+    capture_log(fn ->
+      {:ok, pid} =
+        start_supervised(
+          daemon_spec("sh", ["-c", "echo oops; exit 2"],
+            tail_bytes: 100,
+            log_output: :error,
+            exit_status_to_reason: fn status, tail -> {:failed, status, tail} end
+          )
+        )
+
+      ref = Process.monitor(pid)
+      assert_receive {:DOWN, ^ref, :process, _object, {:failed, 2, "oops\n"}}, 1000
+
+      :ok = stop_supervised(:test_daemon)
+    end)
+  end
+
+  test "output that's only kept for the tail isn't sent to the daemon" do
+    capture_log(fn ->
+      {:ok, pid} =
+        start_supervised(
+          daemon_spec("sh", ["-c", "echo oops >&2; sleep 0.5; exit 2"],
+            tail_bytes: 100,
+            stderr_to_stdout: true,
+            exit_status_to_reason: fn status, tail -> {:failed, status, tail} end
+          )
+        )
+
+      ref = Process.monitor(pid)
+      wait_for_close_check(200)
+      assert %{output_byte_count: 0} = Daemon.statistics(pid)
+
+      assert_receive {:DOWN, ^ref, :process, _object, {:failed, 2, "oops\n"}}, 1000
+
+      :ok = stop_supervised(:test_daemon)
+    end)
+  end
+
+  test "commands run with the default SIGPIPE handling when there's a tail" do
+    capture_log(fn ->
+      {:ok, pid} =
+        start_supervised(
+          daemon_spec("sh", ["-c", "kill -PIPE $$; echo survived"],
+            tail_bytes: 100,
+            exit_status_to_reason: fn status, tail -> {:failed, status, tail} end
+          )
+        )
+
+      ref = Process.monitor(pid)
+      assert_receive {:DOWN, ^ref, :process, _object, {:failed, 141, ""}}, 1000
+
+      :ok = stop_supervised(:test_daemon)
+    end)
+  end
+
   defp s2n(name, default) do
     with :error <- s2n_kill_l_name(name),
          :error <- s2n_kill_l(name) do
@@ -536,6 +702,145 @@ defmodule DaemonTest do
     assert length(split) == 1001
   end
 
+  test "flow control when logging with protocol 2" do
+    fun = fn ->
+      {:ok, _pid} =
+        start_supervised(
+          daemon_spec(test_path("print_a_lot.test"), [],
+            log_output: :error,
+            stdio_window: 101,
+            protocol: 2
+          )
+        )
+
+      wait_for_close_check(200)
+      Logger.flush()
+    end
+
+    results = capture_log(fun)
+
+    split =
+      String.split(results, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")
+
+    assert length(split) == 1001
+  end
+
+  test "statistics report the stdio window" do
+    {:ok, pid} = start_supervised(daemon_spec("sleep", ["10"], stdio_window: 4096))
+    assert Daemon.statistics(pid).stdio_window == 4096
+  end
+
+  test "adaptive stdio windows start within their range" do
+    {:ok, pid} = start_supervised(daemon_spec("sleep", ["10"], stdio_window: 16384..65536))
+    assert Daemon.statistics(pid).stdio_window == 16384
+  end
+
+  test "muontrap frames lines with max_line_length" do
+    fun = fn ->
+      {:ok, _pid} =
+        start_supervised(
+          daemon_spec(test_path("print_a_lot.test"), [],
+            log_output: :error,
+            stdio_window: 101,
+            max_line_length: 100
+          )
+        )
+
+      wait_for_close_check(200)
+      Logger.flush()
+    end
+
+    results = capture_log(fun)
+
+    split =
+      String.split(results, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")
+
+    assert length(split) == 1001
+  end
+
+  test "muontrap marks truncated lines" do
+    long_line = String.duplicate("x", 1000)
+
+    fun = fn ->
+      {:ok, pid} =
+        start_supervised(
+          daemon_spec("sh", ["-c", "echo #{long_line}; echo short; sleep 10"],
+            log_output: :error,
+            max_line_length: 600
+          )
+        )
+
+      wait_for_output(pid, 607, 500)
+      Logger.flush()
+    end
+
+    log = capture_log(fun)
+    assert log =~ String.duplicate("x", 600) <> "..."
+    refute log =~ String.duplicate("x", 601)
+    assert log =~ "short"
+  end
+
+  test "muontrap logs a last line that doesn't end with a newline" do
+    test_process = self()
+    logger = fn line -> send(test_process, {:logged, line}) end
+
+    # The command can exit before muontrap reads the end of its output, so
+    # run it a few times
+    for _ <- 1..10 do
+      {:ok, _pid} =
+        start_supervised(
+          daemon_spec("printf", ["first\\nlast"], logger_fun: logger, max_line_length: 100),
+          restart: :temporary
+        )
+
+      assert_receive {:logged, "first"}, 500
+      assert_receive {:logged, "last"}, 500
+      stop_supervised(:test_daemon)
+    end
+  end
+
+  test "daemon forwards writes to the command's stdin" do
+    fun = fn ->
+      {:ok, pid} =
+        start_supervised(
+          daemon_spec("cat", [], log_output: :error, forward_stdin: true, max_line_length: 1000)
+        )
+
+      assert :ok == Daemon.write(pid, "hello\n")
+      assert :ok == Daemon.write(pid, ["big ", String.duplicate("x", 200_000), "\n"])
+      assert :ok == Daemon.write(pid, "bye\n")
+
+      wait_for_output(pid, 6 + 1001 + 4, 2000)
+      Logger.flush()
+    end
+
+    log = capture_log(fun)
+    assert log =~ "hello"
+    assert log =~ "big xxx"
+    assert log =~ "bye"
+  end
+
+  test "closing stdin lets the command exit" do
+    {:ok, pid} =
+      start_supervised(
+        Supervisor.child_spec({Daemon, ["cat", [], [forward_stdin: true]]},
+          id: :test_daemon,
+          restart: :temporary
+        )
+      )
+
+    ref = Process.monitor(pid)
+    assert :ok == Daemon.write(pid, "hello\n")
+    assert :ok == Daemon.close_stdin(pid)
+    assert_receive {:DOWN, ^ref, :process, ^pid, :normal}, 2000
+  end
+
+  test "writing requires forward_stdin" do
+    {:ok, pid} = start_supervised(daemon_spec("sleep", ["10"]))
+    assert {:error, :not_forwarding} == Daemon.write(pid, "hello")
+    assert {:error, :not_forwarding} == Daemon.close_stdin(pid)
+  end
+
   test "line splits on newlines" do
     # Daemon.process_data(data) :: {lines, leftovers}
     assert {[], "abcd"} == Daemon.process_data("abcd")
@@ -564,6 +869,19 @@ defmodule DaemonTest do
     assert {["abc"], a256} == Daemon.process_data("abc\n" <> a265)
   end
 
+  test "line splits carry partial lines across chunks" do
+    {[], partial} = Daemon.process_data("", "ab", 5)
+    {[], partial} = Daemon.process_data(partial, "cd", 5)
+    assert {["abcdef", "gh"], "i"} == Daemon.process_data(partial, "ef\ngh\ni", 5)
+
+    # Partial lines stop growing at the max length
+    {[], partial} = Daemon.process_data("", "abc", 5)
+    {[], partial} = Daemon.process_data(partial, "defg", 5)
+    assert IO.iodata_to_binary(partial) == "abcde"
+    assert {[], ^partial} = Daemon.process_data(partial, "hij", 5)
+    assert {["abcde"], ""} == Daemon.process_data(partial, "\n", 5)
+  end
+
   test "daemon inspects non-utf8 strings" do
     output =
       capture_io(:user, fn ->
@@ -662,6 +980,41 @@ defmodule DaemonTest do
     assert log =~ "stdout message"
   end
 
+  test "daemon logs stderr separately at its own level" do
+    fun = fn ->
+      {:ok, pid} =
+        start_supervised(
+          daemon_spec(test_path("echo_both.test"), [],
+            log_output: :info,
+            stderr_log_output: :error
+          )
+        )
+
+      wait_for_output(pid, 30, 500)
+      Logger.flush()
+    end
+
+    log = capture_log(fun)
+    assert log =~ ~r/\[info\].*stdout message/
+    assert log =~ ~r/\[error\].*stderr message/
+  end
+
+  test "daemon logs only stderr with stderr_log_output alone" do
+    fun = fn ->
+      {:ok, pid} =
+        start_supervised(
+          daemon_spec(test_path("echo_both.test"), [], stderr_log_output: :error)
+        )
+
+      wait_for_output(pid, 15, 500)
+      Logger.flush()
+    end
+
+    log = capture_log(fun)
+    assert log =~ "stderr message"
+    refute log =~ "stdout message"
+  end
+
   test "wait_for defers launching the OS process until it returns" do
     parent = self()
 
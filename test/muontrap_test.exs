@@ -122,6 +122,112 @@ defmodule MuonTrapTest do
     assert length(split) == 1001
   end
 
+  test "cmd/3 that prints a lot w/ protocol 2" do
+    for window <- [63, 4_000_000] do
+      opts = [protocol: 2, stdio_window: window]
+
+      {output, 0} = MuonTrap.cmd(test_path("print_a_lot.test"), [], opts)
+
+      split =
+        String.split(output, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")
+
+      assert length(split) == 1001
+    end
+  end
+
+  test "cmd/3 that prints a lot w/ an adaptive window" do
+    {output, 0} = MuonTrap.cmd(test_path("print_a_lot.test"), [], stdio_window: 64..1_048_576)
+    split = String.split(output, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")
+    assert length(split) == 1001
+  end
+
+  test "cmd/3 in high throughput mode" do
+    data = :crypto.strong_rand_bytes(5_000_000)
+    assert {data, 0} == MuonTrap.cmd("cat", [], input: data, high_throughput: true)
+  end
+
+  test "cmd/3 batches output" do
+    for protocol <- [1, 2], window <- [100, 10_240] do
+      opts = [protocol: protocol, stdio_window: window, batch_bytes: 4096, batch_usecs: 2000]
+
+      {output, 0} = MuonTrap.cmd(test_path("print_a_lot.test"), [], opts)
+
+      split =
+        String.split(output, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")
+
+      assert length(split) == 1001
+    end
+
+    # Output that doesn't fill a batch still comes out
+    assert {"a\nb\n", 0} ==
+             MuonTrap.cmd("sh", ["-c", "echo a; sleep 0.1; echo b"], batch_bytes: 4096)
+  end
+
+  test "stream/3 returns the output in chunks" do
+    for opts <- [[stdio_window: 63], [protocol: 2, stdio_window: 100]] do
+      chunks = MuonTrap.stream(test_path("print_a_lot.test"), [], opts) |> Enum.to_list()
+      assert length(chunks) > 1
+
+      split =
+        chunks
+        |> IO.iodata_to_binary()
+        |> String.split("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")
+
+      assert length(split) == 1001
+    end
+  end
+
+  test "stream/3 kills the command when the stream is halted" do
+    [pid_line] =
+      MuonTrap.stream("/bin/sh", ["-c", "echo $$; exec sleep 100"]) |> Enum.take(1)
+
+    wait_for_close_check()
+    pid_line |> String.trim() |> String.to_integer() |> assert_os_pid_exited()
+    refute_received {port, _} when is_port(port)
+  end
+
+  test "stream/3 rejects cmd/3-only options" do
+    assert_raise ArgumentError, fn -> MuonTrap.stream("echo", [], into: []) end
+    assert_raise ArgumentError, fn -> MuonTrap.stream("echo", [], timeout: 100) end
+  end
+
+  test "cmd/3 collects stderr separately" do
+    assert {{"out\n", "err\n"}, 0} ==
+             MuonTrap.cmd("sh", ["-c", "echo out; echo err >&2"], stderr_into: "")
+
+    assert {{["out\n"], "err\n"}, 3} ==
+             MuonTrap.cmd("sh", ["-c", "echo out; echo err >&2; exit 3"],
+               into: [],
+               stderr_into: ""
+             )
+  end
+
+  test "cmd/3 writes input to stdin" do
+    assert {"HELLO", 0} == MuonTrap.cmd("tr", ["a-z", "A-Z"], input: "hello")
+    assert {"", 0} == MuonTrap.cmd("cat", [], input: "")
+
+    input = :crypto.strong_rand_bytes(1_000_000)
+    assert {input, 0} == MuonTrap.cmd("cat", [], input: input, stdio_window: 65536)
+    {count, 0} = MuonTrap.cmd("wc", ["-c"], input: ["ab", ?c, ["def"]])
+    assert String.trim(count) == "6"
+  end
+
+  test "cmd/3 returns resource usage" do
+    script = "echo out; head -c 10000000 /dev/zero | cksum >/dev/null; exit 3"
+    {"out\n", 3, usage} = MuonTrap.cmd("sh", ["-c", script], resource_usage: true)
+
+    rusage = usage["rusage"]
+    assert rusage["utime_usec"] + rusage["stime_usec"] > 0
+    assert rusage["maxrss_kb"] > 0
+    assert Map.has_key?(rusage, "nvcsw")
+  end
+
+  test "cmd/3 with resource usage runs commands with the default SIGPIPE handling" do
+    script = "kill -PIPE $$; echo survived"
+    assert {"", 141, _usage} = MuonTrap.cmd("sh", ["-c", script], resource_usage: true)
+    assert [{"", 141, _usage}] = MuonTrap.Batch.run([{"sh", ["-c", script]}])
+  end
+
   test "cmd/3 doesn't kill concurrent callers with :epipe" do
     # Exiting while acks for captured output were in flight used to kill the
     # caller with :epipe. The race needs scheduler load to trigger, so run
@@ -143,6 +249,13 @@ defmodule MuonTrapTest do
     end
   end
 
+  test "cmd/3 returns when a background process keeps writing" do
+    for opts <- [[], [protocol: 2], [protocol: 2, batch_bytes: 4096]] do
+      assert {output, 0} = MuonTrap.cmd("sh", ["-c", "yes & sleep 0.1"], [timeout: 5000] ++ opts)
+      assert String.starts_with?(output, "y\ny\n")
+    end
+  end
+
   test "cmd/3 with timeout" do
     opts = [timeout: 250]
 
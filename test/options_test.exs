@@ -23,6 +23,18 @@ defmodule MuonTrap.OptionsTest do
     end
   end
 
+  test "cgroup_pool supplies the cgroup" do
+    options = Options.validate(:cmd, "echo", [], cgroup_pool: :pool)
+    assert options.cgroup_pool == :pool
+    refute Map.has_key?(options, :cgroup_path)
+
+    for opt <- [cgroup_base: "base", cgroup_path: "path", cgroup: %{cpu_weight: 50}] do
+      assert_raise ArgumentError, ~r/cgroup_pool/, fn ->
+        Options.validate(:daemon, "echo", [], [{:cgroup_pool, :pool}, opt])
+      end
+    end
+  end
+
   test "errors match System.cmd ones" do
     for context <- [:cmd, :daemon] do
       # :enoent on missing executable
@@ -235,6 +247,242 @@ defmodule MuonTrap.OptionsTest do
     refute Map.has_key?(options, :cgroup_path)
   end
 
+  test "accepts protocol versions 1 and 2" do
+    for context <- [:daemon, :cmd], version <- [1, 2] do
+      assert Options.validate(context, "echo", [], protocol: version).protocol == version
+    end
+
+    assert_raise ArgumentError, ~r/invalid option :protocol/, fn ->
+      Options.validate(:cmd, "echo", [], protocol: 3)
+    end
+  end
+
+  test "high_throughput sets up big pipes and a big window" do
+    options = Options.validate(:cmd, "echo", [], high_throughput: true)
+    assert options.pipe_size == 1_048_576
+    assert options.stdio_window == 4_194_304
+    assert options.protocol == 2
+
+    options = Options.validate(:cmd, "echo", [], high_throughput: true, stdio_window: 65536)
+    assert options.stdio_window == 65536
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], high_throughput: true, protocol: 1)
+    end
+  end
+
+  test "batch options" do
+    options = Options.validate(:cmd, "echo", [], batch_bytes: 4096, batch_usecs: 1000)
+    assert options.batch_bytes == 4096
+    assert options.batch_usecs == 1000
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], batch_usecs: 1000)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], batch_bytes: 100_000)
+    end
+  end
+
+  test "stdio_window ranges use protocol 2" do
+    for context <- [:daemon, :cmd] do
+      options = Options.validate(context, "echo", [], stdio_window: 1024..65536)
+      assert options.stdio_window == 1024..65536
+      assert options.protocol == 2
+    end
+
+    refute Map.has_key?(Options.validate(:cmd, "echo", [], stdio_window: 1024), :protocol)
+
+    assert_raise ArgumentError, ~r/requires protocol 2/, fn ->
+      Options.validate(:cmd, "echo", [], stdio_window: 1024..65536, protocol: 1)
+    end
+
+    assert_raise ArgumentError, ~r/invalid option :stdio_window/, fn ->
+      Options.validate(:cmd, "echo", [], stdio_window: 8..65536)
+    end
+
+    assert_raise ArgumentError, ~r/invalid option :stdio_window/, fn ->
+      Options.validate(:cmd, "echo", [], stdio_window: 65536..1024)
+    end
+  end
+
+  test "separate stderr uses protocol 2" do
+    assert Options.validate(:cmd, "echo", [], stderr_into: []).protocol == 2
+    assert Options.validate(:daemon, "echo", [], stderr_log_output: :error).protocol == 2
+
+    assert_raise ArgumentError, ~r/cannot specify both :stderr_into and :stderr_to_stdout/, fn ->
+      Options.validate(:cmd, "echo", [], stderr_into: "", stderr_to_stdout: true)
+    end
+
+    assert_raise ArgumentError, ~r/requires protocol 2/, fn ->
+      Options.validate(:daemon, "echo", [], stderr_log_output: :error, protocol: 1)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], stderr_into: "")
+    end
+  end
+
+  test "max_line_length uses protocol 2 and must fit in the window" do
+    assert Options.validate(:daemon, "echo", [], max_line_length: 4096).protocol == 2
+
+    assert Options.validate(:daemon, "echo", [], max_line_length: 100, stdio_window: 101)
+           |> Map.get(:max_line_length) == 100
+
+    assert_raise ArgumentError, ~r/must be less than the :stdio_window \(10240\)/, fn ->
+      Options.validate(:daemon, "echo", [], max_line_length: 10240)
+    end
+
+    assert_raise ArgumentError, ~r/must be less than the :stdio_window \(1024\)/, fn ->
+      Options.validate(:daemon, "echo", [], max_line_length: 2048, stdio_window: 1024..65536)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], max_line_length: 100)
+    end
+  end
+
+  test "stdin forwarding uses protocol 2" do
+    options = Options.validate(:cmd, "cat", [], input: ["ab", ?c])
+    assert options.input == "abc"
+    assert options.protocol == 2
+
+    assert Options.validate(:daemon, "cat", [], forward_stdin: true).protocol == 2
+    refute Map.has_key?(Options.validate(:daemon, "cat", [], forward_stdin: false), :protocol)
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "cat", [], input: "abc")
+    end
+  end
+
+  test "output_file options" do
+    options =
+      Options.validate(:daemon, "echo", [],
+        output_file: "/tmp/out.log",
+        output_file_max_bytes: 1_000_000,
+        output_file_keep: 3
+      )
+
+    assert options.output_file == "/tmp/out.log"
+    refute Map.has_key?(options, :protocol)
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], output_file_keep: 3)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], output_file: "/tmp/out.log", log_output: :info)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], output_file: "/tmp/out.log")
+    end
+  end
+
+  test "resource_usage uses protocol 2" do
+    assert Options.validate(:cmd, "echo", [], resource_usage: true).protocol == 2
+    assert Options.validate(:daemon, "echo", [], resource_usage: true).protocol == 2
+    refute Map.has_key?(Options.validate(:cmd, "echo", [], resource_usage: false), :protocol)
+  end
+
+  test "stats_interval requires a cgroup" do
+    options = Options.validate(:daemon, "echo", [], stats_interval: 500, cgroup_base: "base")
+    assert options.protocol == 2
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], stats_interval: 500)
+    end
+  end
+
+  test "stats_collector is daemon-only" do
+    options = Options.validate(:daemon, "echo", [], stats_collector: :collector)
+    assert options.stats_collector == :collector
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], stats_collector: :collector)
+    end
+  end
+
+  test "pressure_triggers" do
+    options =
+      Options.validate(:daemon, "echo", [],
+        pressure_triggers: [{:memory, :some, 150_000, 2_000_000}],
+        event_handler: self(),
+        cgroup_base: "base"
+      )
+
+    assert options.pressure_triggers == [{:memory, :some, 150_000, 2_000_000}]
+    assert options.protocol == 2
+
+    # No event handler
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [],
+        pressure_triggers: [{:memory, :some, 150_000, 2_000_000}],
+        cgroup_base: "base"
+      )
+    end
+
+    # No cgroup
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [],
+        pressure_triggers: [{:memory, :some, 150_000, 2_000_000}],
+        event_handler: self()
+      )
+    end
+
+    for trigger <- [
+          {:disk, :some, 150_000, 2_000_000},
+          {:cpu, :most, 150_000, 2_000_000},
+          {:cpu, :full, 3_000_000, 2_000_000},
+          {:cpu, :full, 150_000, 20_000_000}
+        ] do
+      assert_raise ArgumentError, fn ->
+        Options.validate(:daemon, "echo", [],
+          pressure_triggers: [trigger],
+          event_handler: self(),
+          cgroup_base: "base"
+        )
+      end
+    end
+  end
+
+  test "cgroup_events" do
+    options =
+      Options.validate(:daemon, "echo", [],
+        cgroup_events: true,
+        event_handler: self(),
+        cgroup_base: "base"
+      )
+
+    assert options.cgroup_events
+    assert options.protocol == 2
+
+    assert_raise ArgumentError, ~r/event_handler/, fn ->
+      Options.validate(:daemon, "echo", [], cgroup_events: true, cgroup_base: "base")
+    end
+
+    assert_raise ArgumentError, ~r/cgroup/, fn ->
+      Options.validate(:daemon, "echo", [], cgroup_events: true, event_handler: self())
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], cgroup_events: true)
+    end
+  end
+
+  test "tail_bytes uses protocol 2" do
+    assert Options.validate(:daemon, "echo", [], tail_bytes: 100).protocol == 2
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:daemon, "echo", [], tail_bytes: 100, protocol: 1)
+    end
+
+    assert_raise ArgumentError, fn ->
+      Options.validate(:cmd, "echo", [], tail_bytes: 100)
+    end
+  end
+
   test "accepts :groups list of integers and binaries (including empty)" do
     options = Options.validate(:cmd, "echo", [], groups: [10, "audio", 100])
     assert options.groups == [10, "audio", 100]
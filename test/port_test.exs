@@ -45,6 +45,19 @@ defmodule MuonTrapPortTest do
            ]
   end
 
+  test "handles reused cgroups" do
+    options = %{cmd: "/bin/echo", args: [], cgroup_path: "test/path", reuse_cgroup: true}
+    port_options = MuonTrap.Port.port_options(options)
+
+    assert Keyword.get(port_options, :args) == [
+             "--group",
+             "test/path",
+             "--reuse-group",
+             "--",
+             "/bin/echo"
+           ]
+  end
+
   test "handles cgroup sets" do
     options = %{cmd: "/bin/echo", args: [], cgroup_sets: [{"cpu", "cpu.max", "50000 100000"}]}
     port_options = MuonTrap.Port.port_options(options)
@@ -207,6 +220,249 @@ defmodule MuonTrapPortTest do
            ]
   end
 
+  test "protocol 2 frames the port" do
+    options = %{cmd: "/bin/echo", args: [], protocol: 2}
+    port_options = MuonTrap.Port.port_options(options)
+
+    assert {:packet, 4} in port_options
+
+    assert Keyword.get(port_options, :args) == [
+             "--protocol",
+             "2",
+             "--",
+             "/bin/echo"
+           ]
+  end
+
+  test "protocol 1 is the default" do
+    options = %{cmd: "/bin/echo", args: [], protocol: 1}
+    port_options = MuonTrap.Port.port_options(options)
+
+    refute {:packet, 4} in port_options
+    assert Keyword.get(port_options, :args) == ["--", "/bin/echo"]
+  end
+
+  test "encodes protocol 2 credits" do
+    assert MuonTrap.Port.encode_credit(1) == <<1, 0, 0, 0, 1>>
+    assert MuonTrap.Port.encode_credit(4_000_000) == <<1, 0, 61, 9, 0>>
+  end
+
+  test "decodes protocol 2 output" do
+    assert MuonTrap.Port.decode(2, <<2, "hello">>) == {:output, "hello"}
+    assert MuonTrap.Port.decode(1, <<2, "hello">>) == {:output, <<2, "hello">>}
+  end
+
+  test "separate stderr" do
+    options = %{cmd: "/bin/echo", args: [], stderr_into: "", protocol: 2}
+
+    assert Keyword.get(MuonTrap.Port.port_options(options), :args) == [
+             "--protocol",
+             "2",
+             "--separate-stderr",
+             "--",
+             "/bin/echo"
+           ]
+  end
+
+  test "line framing" do
+    options = %{cmd: "/bin/echo", args: [], max_line_length: 1024, protocol: 2}
+
+    assert Keyword.get(MuonTrap.Port.port_options(options), :args) == [
+             "--line-max",
+             "1024",
+             "--protocol",
+             "2",
+             "--",
+             "/bin/echo"
+           ]
+
+    assert MuonTrap.Port.decode(2, <<5, 0, "hello">>) == {:line, :stdout, "hello", false}
+    assert MuonTrap.Port.decode(2, <<5, 1, "">>) == {:line, :stderr, "", false}
+    assert MuonTrap.Port.decode(2, <<5, 3, "hel">>) == {:line, :stderr, "hel", true}
+  end
+
+  test "stdin forwarding" do
+    options = %{cmd: "/bin/cat", args: [], input: "hello", protocol: 2}
+
+    assert Keyword.get(MuonTrap.Port.port_options(options), :args) == [
+             "--forward-stdin",
+             "--protocol",
+             "2",
+             "--",
+             "/bin/cat"
+           ]
+
+    assert MuonTrap.Port.decode(2, <<8, 4096::32>>) == {:stdin_credit, 4096}
+  end
+
+  test "output file" do
+    options = %{
+      cmd: "/bin/echo",
+      args: [],
+      output_file: "out.log",
+      output_file_keep: 2,
+      output_file_max_bytes: 4096
+    }
+
+    assert Keyword.get(MuonTrap.Port.port_options(options), :args) == [
+             "--output-file",
+             "out.log",
+             "--output-file-keep",
+             "2",
+             "--output-file-max-bytes",
+             "4096",
+             "--",
+             "/bin/echo"
+           ]
+  end
+
+  test "resource usage" do
+    options = %{cmd: "/bin/echo", args: [], resource_usage: true, protocol: 2}
+
+    assert Keyword.get(MuonTrap.Port.port_options(options), :args) == [
+             "--protocol",
+             "2",
+             "--resource-usage",
+             "--",
+             "/bin/echo"
+           ]
+
+    rusage = "utime_usec 1500\nstime_usec 20\nmaxrss_kb 1024\n"
+    io_stat = "8:0 rbytes=4096 wbytes=0 rios=1 wios=0 dbytes=0 dios=0\n"
+
+    packet =
+      <<10, 6, "rusage", byte_size(rusage)::32, rusage::binary, 11, "memory.peak", 6::32,
+        "65536\n", 7, "io.stat", byte_size(io_stat)::32, io_stat::binary>>
+
+    assert MuonTrap.Port.decode(2, packet) ==
+             {:resource_usage,
+              %{
+                "rusage" => %{"utime_usec" => 1500, "stime_usec" => 20, "maxrss_kb" => 1024},
+                "memory.peak" => 65536,
+                "io.stat" => %{
+                  "8:0" => %{
+                    "rbytes" => 4096,
+                    "wbytes" => 0,
+                    "rios" => 1,
+                    "wios" => 0,
+                    "dbytes" => 0,
+                    "dios" => 0
+                  }
+                }
+              }}
+  end
+
+  test "cgroup stats samples" do
+    options = %{cmd: "/bin/echo", args: [], stats_interval: 1000, protocol: 2}
+
+    assert Keyword.get(MuonTrap.Port.port_options(options), :args) == [
+             "--protocol",
+             "2",
+             "--stats-interval",
+             "1000",
+             "--",
+             "/bin/echo"
+           ]
+
+    packet = <<11, 1001::32, 1, 4_194_304::64, 4, 12_345::64, 10, 7::64, 99, 1::64>>
+
+    assert MuonTrap.Port.decode(2, packet) ==
+             {:stats, 1001,
+              %{memory_current: 4_194_304, cpu_percent: 123.45, cpu_pressure_avg10: 0.07}}
+  end
+
+  test "pressure triggers" do
+    options = %{
+      cmd: "/bin/echo",
+      args: [],
+      pressure_triggers: [{:memory, :some, 150_000, 2_000_000}, {:io, :full, 50_000, 500_000}],
+      protocol: 2
+    }
+
+    assert Keyword.get(MuonTrap.Port.port_options(options), :args) == [
+             "--pressure-trigger",
+             "memory:some:150000:2000000",
+             "--pressure-trigger",
+             "io:full:50000:500000",
+             "--protocol",
+             "2",
+             "--",
+             "/bin/echo"
+           ]
+
+    packet =
+      <<12, 1, "some avg10=17.93 avg60=3.23 avg300=0.67 total=2035767\n",
+        "full avg10=0.18 avg60=0.03 avg300=0.00 total=22395\n">>
+
+    assert MuonTrap.Port.decode(2, packet) ==
+             {:pressure, 1,
+              %{
+                "some" => %{
+                  "avg10" => 17.93,
+                  "avg60" => 3.23,
+                  "avg300" => 0.67,
+                  "total" => 2_035_767
+                },
+                "full" => %{"avg10" => 0.18, "avg60" => 0.03, "avg300" => 0.0, "total" => 22395}
+              }}
+  end
+
+  test "cgroup events" do
+    options = %{cmd: "/bin/echo", args: [], cgroup_events: true, protocol: 2}
+
+    assert Keyword.get(MuonTrap.Port.port_options(options), :args) == [
+             "--cgroup-events",
+             "--protocol",
+             "2",
+             "--",
+             "/bin/echo"
+           ]
+
+    assert MuonTrap.Port.decode(2, <<13, 0, "max 3\noom 1\noom_kill 1\n">>) ==
+             {:cgroup_events, :memory_events, %{"max" => 3, "oom" => 1, "oom_kill" => 1}}
+
+    assert MuonTrap.Port.decode(2, <<13, 1, "max 2\n">>) ==
+             {:cgroup_events, :pids_events, %{"max" => 2}}
+  end
+
+  test "output tail" do
+    options = %{cmd: "/bin/echo", args: [], tail_bytes: 1024, protocol: 2}
+
+    assert Keyword.get(MuonTrap.Port.port_options(options), :args) == [
+             "--protocol",
+             "2",
+             "--tail-bytes",
+             "1024",
+             "--",
+             "/bin/echo"
+           ]
+
+    assert MuonTrap.Port.decode(2, <<9, "last words\n">>) == {:tail, "last words\n"}
+  end
+
+  test "adaptive stdio window" do
+    options = %{cmd: "/bin/echo", args: [], stdio_window: 1024..65536, protocol: 2}
+
+    assert Keyword.get(MuonTrap.Port.port_options(options), :args) == [
+             "--protocol",
+             "2",
+             "--stdio-window-min",
+             "1024",
+             "--stdio-window-max",
+             "65536",
+             "--",
+             "/bin/echo"
+           ]
+
+    assert MuonTrap.Port.decode(2, <<3, 65536::32>>) == {:window, 65536}
+    assert MuonTrap.Port.decode(2, <<4, "oops">>) == {:stderr, "oops"}
+    assert MuonTrap.Port.initial_stdio_window(options) == 10240
+    assert MuonTrap.Port.initial_stdio_window(%{stdio_window: 16384..65536}) == 16384
+    assert MuonTrap.Port.initial_stdio_window(%{stdio_window: 16..256}) == 256
+    assert MuonTrap.Port.initial_stdio_window(%{stdio_window: 1024}) == 1024
+    assert MuonTrap.Port.initial_stdio_window(%{}) == 10240
+  end
+
   defp encode_acks(number) do
     number
     |> MuonTrap.Port.encode_acks()
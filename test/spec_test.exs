@@ -0,0 +1,55 @@
+# SPDX-FileCopyrightText: 2025 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule MuonTrap.SpecTest do
+  use MuonTrapTest.Case
+
+  alias MuonTrap.Spec
+
+  doctest MuonTrap.Spec
+
+  test "validates options when the spec is made" do
+    assert_raise ArgumentError, fn -> Spec.new(:cmd, "echo", [], stdio_window: :big) end
+    assert_raise ArgumentError, fn -> Spec.new(:cmd, "echo", [], name: :foo) end
+    assert :enoent = catch_error(Spec.new(:cmd, "does_not_exist_anywhere", []))
+  end
+
+  test "launches have the same port options as cmd/3" do
+    opts = [stdio_window: 100, protocol: 2, env: [{"FOO", "bar"}]]
+    options = MuonTrap.Options.validate(:cmd, "echo", ["hi"], opts)
+
+    assert {^options, port_options} = Spec.launch(Spec.new(:cmd, "echo", ["hi"], opts))
+    assert port_options == MuonTrap.Port.port_options(options, ["--capture-output"])
+  end
+
+  test "each launch gets a new cgroup under the :cgroup_base" do
+    spec = Spec.new(:cmd, "echo", [], cgroup_base: "muontrap_test", cgroup: %{cpu_weight: 100})
+
+    {%{cgroup_path: path1}, port_options1} = Spec.launch(spec)
+    {%{cgroup_path: path2}, port_options2} = Spec.launch(spec)
+
+    assert path1 != path2
+    assert ["--group", ^path1 | _] = Keyword.fetch!(port_options1, :args)
+    assert ["--group", ^path2 | _] = Keyword.fetch!(port_options2, :args)
+  end
+
+  test "specs only run where they were made for" do
+    assert_raise ArgumentError, fn -> MuonTrap.cmd(Spec.new(:daemon, "echo", [])) end
+    assert_raise ArgumentError, fn -> MuonTrap.Daemon.start_link(Spec.new(:cmd, "echo", [])) end
+  end
+
+  test "daemon restarts from a spec" do
+    spec = Spec.new(:daemon, test_path("echo_stdio.test"), [], name: :spec_daemon)
+
+    pid = start_supervised!({MuonTrap.Daemon, spec})
+    assert Process.whereis(:spec_daemon) == pid
+    assert is_integer(MuonTrap.Daemon.os_pid(pid))
+
+    Process.exit(pid, :kill)
+    wait_for_close_check()
+
+    new_pid = Process.whereis(:spec_daemon)
+    assert is_pid(new_pid) and new_pid != pid
+  end
+end
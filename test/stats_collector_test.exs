@@ -0,0 +1,95 @@
+# SPDX-FileCopyrightText: 2025 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule MuonTrap.StatsCollectorTest do
+  use ExUnit.Case
+
+  alias MuonTrap.StatsCollector
+
+  @moduletag :tmp_dir
+
+  # Cgroup paths are relative to /sys/fs/cgroup, so point one at the test's
+  # directory to control what the collector reads
+  defp fake_cgroup(tmp_dir, memory_current) do
+    File.write!(Path.join(tmp_dir, "memory.current"), "#{memory_current}\n")
+    "../../.." <> tmp_dir
+  end
+
+  defp register_from_new_process(collector, cgroup_path) do
+    test_process = self()
+
+    pid =
+      spawn(fn ->
+        :ok = StatsCollector.register(collector, cgroup_path)
+        send(test_process, :registered)
+        Process.sleep(:infinity)
+      end)
+
+    assert_receive :registered
+    pid
+  end
+
+  test "registering reads the statistics right away", %{tmp_dir: tmp_dir} do
+    start_supervised!({StatsCollector, name: :test_collector, ttl: 60_000})
+    cgroup_path = fake_cgroup(tmp_dir, 1000)
+
+    assert :ok = StatsCollector.register(:test_collector, cgroup_path)
+    assert StatsCollector.statistics(:test_collector, self()) == %{"memory.current" => 1000}
+    assert StatsCollector.all(:test_collector) == %{self() => %{"memory.current" => 1000}}
+  end
+
+  test "unregistered daemons have no statistics" do
+    start_supervised!({StatsCollector, name: :test_collector})
+
+    assert StatsCollector.statistics(:test_collector, self()) == %{}
+    assert StatsCollector.all(:test_collector) == %{}
+  end
+
+  test "the default name is the module" do
+    start_supervised!(StatsCollector)
+
+    assert Process.whereis(StatsCollector)
+    assert StatsCollector.all() == %{}
+  end
+
+  test "sweeps refresh the statistics every ttl", %{tmp_dir: tmp_dir} do
+    start_supervised!({StatsCollector, name: :test_collector, ttl: 20})
+    cgroup_path = fake_cgroup(tmp_dir, 1000)
+    :ok = StatsCollector.register(:test_collector, cgroup_path)
+
+    fake_cgroup(tmp_dir, 2000)
+    Process.sleep(100)
+
+    assert StatsCollector.statistics(:test_collector, self()) == %{"memory.current" => 2000}
+  end
+
+  test "registering again replaces the cgroup", %{tmp_dir: tmp_dir} do
+    start_supervised!({StatsCollector, name: :test_collector, ttl: 60_000})
+    other_dir = Path.join(tmp_dir, "other")
+    File.mkdir_p!(other_dir)
+
+    :ok = StatsCollector.register(:test_collector, fake_cgroup(tmp_dir, 1000))
+    :ok = StatsCollector.register(:test_collector, fake_cgroup(other_dir, 5000))
+
+    assert StatsCollector.all(:test_collector) == %{self() => %{"memory.current" => 5000}}
+  end
+
+  test "daemons are removed when they exit", %{tmp_dir: tmp_dir} do
+    collector = start_supervised!({StatsCollector, name: :test_collector, ttl: 60_000})
+    cgroup_path = fake_cgroup(tmp_dir, 1000)
+
+    pid1 = register_from_new_process(:test_collector, cgroup_path)
+    pid2 = register_from_new_process(:test_collector, cgroup_path)
+    assert Map.keys(StatsCollector.all(:test_collector)) |> Enum.sort() == Enum.sort([pid1, pid2])
+
+    Process.exit(pid1, :kill)
+
+    # The :DOWN message is handled before this call
+    _ = :sys.get_state(collector)
+    assert StatsCollector.statistics(:test_collector, pid1) == %{}
+    assert Map.keys(StatsCollector.all(:test_collector)) == [pid2]
+
+    Process.exit(pid2, :kill)
+  end
+end